@@ -3,7 +3,8 @@
  * written by: Andrew Farabee (pasca1)                  *
  *             me@andrewfarabee.com                     *
  *                                                      *
- * INSTALL using "gcc -o nctyping nctyping.c -lncurses" *
+ * INSTALL using                                        *
+ *   "gcc -o nctyping nctyping.c -lncurses -lpthread"   *
  *                                                      *
  * ISSUES: stdin not working from pipe                  *
  *         time() is still nonmonotonic but used less   *
@@ -13,7 +14,16 @@
  *******************************************************/
 
 #include <ncurses.h>
+#include <pthread.h>
+#include <fnmatch.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <time.h>
 #include <string.h>
@@ -40,13 +50,211 @@ enum CommentMask {
     TRIPLEDQUOTEBLOCK = 2048
 };
 
+/* sizes for the n-gram index used by drill mode, n-grams are made of chars
+ * mapped onto a 96 letter alphabet (newline + printable ascii) */
+enum NgramIndex {
+    NGRAM_ALPHABET = 96,
+    NGRAM_BIGRAMS = 96 * 96,
+    NGRAM_BUCKETS = 96 * 96 + 96 * 96 * 96,
+    PASSAGE_SIZE = 2048,  /* passages are cut at the first newline after */
+    NGRAM_POSTINGS = 4096, /* passages kept per n-gram, the richest ones */
+    DRILL_NGRAMS = 32,    /* how many of the weakest n-grams drive a drill */
+    DRILL_ROUNDS = 5      /* passages typed per drill session */
+};
+
+/* random passages typed by a warm-up with -w, how many lines they have and
+ * how far back comments are looked for before them */
+enum Warmup {
+    WARMUP_ROUNDS = 3,
+    WARMUP_LINES = 20,
+    WARMUP_CONTEXT = 4096
+};
+
+/* number of threads used to walk directories given with -r */
+enum { WALK_THREADS = 4 };
+
 /* structure for returning results of each "typing" */
 struct scoring {
     int right;
     int wrong;
     int time;
+    long latency_total;  /* microseconds from keystroke to screen update */
+    long latency_max;
+    int latency_samples;
+    long ghost_total;    /* microseconds spent redrawing the ghost */
+    long ghost_max;
+    int ghost_samples;
+};
+
+/* files and state shared by every buffer typed in a session */
+struct session {
+    const char *savepath;   /* saved positions, see save_progress() */
+    const char *weakpath;   /* weakness table, see save_weakness() */
+    const char *ghostpath;  /* best runs, see save_ghosts() */
+    const char *linedir;    /* line indexes of read-only files, or NULL */
+    int *weak;
+    struct arena *document; /* reset for every document typed */
+    struct arena *screen;   /* reset for every screen in type_buffer() */
+};
+
+/* a run of one screen: the cursor position after every keystroke and when it
+ * was made, in ms since the first keystroke */
+struct timeline {
+    int *times;
+    int *positions;
+    int count;
+    int capacity;
+    struct arena *arena;  /* where times and positions are allocated */
+};
+
+/* state for racing a ghost through one screen of typing() */
+struct race {
+    struct timeline ghost;  /* best previous run, empty if there is none */
+    struct timeline run;    /* this run as it is typed */
+    int next;               /* next ghost event to replay */
+    int position;           /* where the ghost cursor is in the buffer */
+    chtype under;           /* the screen cell the ghost cursor covers */
+    int gx, gy;             /* ghost cell on screen, gx == 0 when hidden */
+    bool finished;          /* whether the screen was typed to the end */
+};
+
+/* ARENAS **********************************************************************
+ * Per-document state (the buffer, its flags and the filename) and per-screen
+ * state in typing() come from bump allocators that are reset between
+ * documents and screens instead of being malloc()d and free()d each time.
+ * When an arena runs out it chains a bigger block, and the next reset folds
+ * everything into one block as big as the high-water mark, so a long session
+ * settles into a fixed amount of memory.  Releasing back to a mark keeps the
+ * biggest block it gives back as a spare for the next time the arena runs
+ * out, so typing one file after another doesn't malloc() a block per file.
+ * Build with -DARENA_DEBUG to print allocation counts and high-water marks
+ * when each arena is freed.
+ */
+
+enum { ARENA_MIN = 64 * 1024, ARENA_ALIGN = 16 };
+
+/* header of each block, its memory follows at ARENA_DATA(block) */
+struct arena_block {
+    struct arena_block *prev;  /* older block that may still be in use */
+    size_t size;
+    size_t used;
 };
 
+#define ARENA_HEADER \
+    ((sizeof(struct arena_block) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_DATA(block) ((char *)(block) + ARENA_HEADER)
+
+struct arena {
+    const char *name;
+    struct arena_block *block;  /* newest block, allocations come from here */
+    struct arena_block *spare;  /* biggest block released, used next */
+    size_t in_use;              /* bytes handed out since the last reset */
+    size_t high;                /* most bytes ever in use at once */
+    long allocs;
+    long blocks;                /* blocks malloc()d */
+    long resets;
+};
+
+/* everything allocated after a mark can be dropped with arena_release() */
+struct arena_mark {
+    struct arena_block *block;
+    size_t used;
+    size_t in_use;
+};
+
+/* returns n bytes from arena, NULL if a new block can't be allocated */
+void *arena_alloc(struct arena *arena, size_t n) {
+    struct arena_block *block = arena->block;
+    size_t size;
+    void *p;
+    n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (!block || block->used + n > block->size) {
+        if (arena->spare && arena->spare->size >= n) {
+            block = arena->spare;
+            arena->spare = NULL;
+        } else {
+            size = block ? block->size * 2 : ARENA_MIN;
+            if (size < n) size = n;
+            block = malloc(ARENA_HEADER + size);
+            if (!block) return NULL;
+            block->size = size;
+            arena->blocks++;
+        }
+        block->prev = arena->block;
+        block->used = 0;
+        arena->block = block;
+    }
+    p = ARENA_DATA(block) + block->used;
+    block->used += n;
+    arena->in_use += n;
+    if (arena->in_use > arena->high) arena->high = arena->in_use;
+    arena->allocs++;
+    return p;
+}
+
+struct arena_mark arena_mark(const struct arena *arena) {
+    struct arena_mark mark;
+    mark.block = arena->block;
+    mark.used = arena->block ? arena->block->used : 0;
+    mark.in_use = arena->in_use;
+    return mark;
+}
+
+/* gives back everything allocated since mark was taken, keeping the biggest
+ * block that is no longer needed as the arena's spare */
+void arena_release(struct arena *arena, struct arena_mark mark) {
+    struct arena_block *prev;
+    while (arena->block != mark.block) {
+        prev = arena->block->prev;
+        if (!arena->spare || arena->spare->size < arena->block->size) {
+            free(arena->spare);
+            arena->spare = arena->block;
+        } else {
+            free(arena->block);
+        }
+        arena->block = prev;
+    }
+    if (arena->block) arena->block->used = mark.used;
+    arena->in_use = mark.in_use;
+}
+
+/* gives back everything in arena, merging chained blocks into one block big
+ * enough for the high-water mark so the next cycle doesn't chain again */
+void arena_reset(struct arena *arena) {
+    struct arena_mark empty = { NULL, 0, 0 };
+    arena->resets++;
+    if (arena->block && arena->block->prev) {
+        arena_release(arena, empty);
+        if (arena->spare->size >= arena->high) {
+            arena->block = arena->spare;
+        } else {
+            free(arena->spare);
+            arena->block = malloc(ARENA_HEADER + arena->high);
+            if (arena->block) arena->block->size = arena->high;
+            arena->blocks++;
+        }
+        arena->spare = NULL;
+        if (arena->block) arena->block->prev = NULL;
+    }
+    if (arena->block) arena->block->used = 0;
+    arena->in_use = 0;
+}
+
+void arena_free(struct arena *arena) {
+    struct arena_block *prev;
+#ifdef ARENA_DEBUG
+    fprintf(stderr, "arena %s: %ld allocations, %ld blocks, %ld resets, "
+            "high-water %zu bytes\n", arena->name, arena->allocs,
+            arena->blocks, arena->resets, arena->high);
+#endif
+    free(arena->spare);
+    while (arena->block) {
+        prev = arena->block->prev;
+        free(arena->block);
+        arena->block = prev;
+    }
+}
+
 /* Used my markComments to know length of each comment field and whitespace */
 int commentLength(const char *buffer, int *i, const char *open,
                   const char *close) {
@@ -57,11 +265,15 @@ int commentLength(const char *buffer, int *i, const char *open,
         pos = strstr((buffer + (*i) + 1), close);
         if (pos) {
             comment_len = (pos + strlen(close)) - (buffer + (*i));
+        } else {
+            /* an unclosed comment runs to the end of the buffer */
+            comment_len = strlen(buffer + (*i));
         }
         /* mark whitespace after comment as part of the comment */
         comment_len += strspn(buffer + (*i) + comment_len, " \t\n");
         /* mark  whitespace before comment as part of the comment */
-        while (buffer[(*i) - 1] == ' ' || buffer[(*i) - 1] == '\n') {
+        while (*i > 0 &&
+               (buffer[(*i) - 1] == ' ' || buffer[(*i) - 1] == '\n')) {
             (*i)--;
             comment_len++;
         }
@@ -70,190 +282,1828 @@ int commentLength(const char *buffer, int *i, const char *open,
             (*i)++;
         }
     }
-    return comment_len;
+    return comment_len;
+}
+
+/* estimates the comment syntax for a file based on filename and contents */
+unsigned short int commentType(char *filename, const char *buffer) {
+    unsigned short int syntax = 0;
+
+    /* only look for the extension in the last component of the path */
+    char *ext = strrchr(filename, '/') ? strrchr(filename, '/') : filename;
+    while (*ext != '.' && *ext) ext++;
+
+    if (*ext == '.') ext++;
+
+    /* Syntax mask so far:
+     * 0-bit = // inline
+     * 1-bit = # inline
+     * 8-bit = / * to * / block (without spaces)
+     * 9-bit = <# to #> block
+     * 10-bit = ''' block
+     * 11-bit = """ block
+     */
+    if (!strcmp(ext, "c") || !strcmp(ext, "h") || !strcmp(ext, "cc") ||
+        !strcmp(ext, "cpp") || !strcmp(ext, "cxx") || !strcmp(ext, "hpp") ||
+        !strcmp(ext, "c++") || !strcmp(ext, "cs") || !strcmp(ext, "java") ||
+        !strcmp(ext, "rs") || !strcmp(ext, "rlib") || !strcmp(ext, "d") ||
+        !strcmp(ext, "js")) {
+        syntax = DOUBLESLASHINLINE | SLASHSTARBLOCK;
+    } else if (!strncmp(buffer, "#!/usr/bin/env py",
+                        strlen("#!/usr/bin/env py")) ||
+               !strcmp(ext, "py") || !strcmp(ext, "pyc") ||
+               !strcmp(ext, "pyd") || !strcmp(ext, "pyo") ||
+               !strcmp(ext, "pyw") || !strcmp(ext, "pyz")) {
+        syntax = SINGLEHASHINLINE | TRIPLESQUOTEBLOCK | TRIPLEDQUOTEBLOCK;
+    } else if (!strncmp(buffer, "#!/usr/bin/env php",
+                        strlen("#!/usr/bin/env php")) ||
+               !strcmp(ext, "php") || !strcmp(ext, "phtml") ||
+               !strcmp(ext, "php3") || !strcmp(ext, "php4") ||
+               !strcmp(ext, "php5") || !strcmp(ext, "php7") ||
+               !strcmp(ext, "phps")) {
+        syntax = DOUBLESLASHINLINE | SINGLEHASHINLINE | SLASHSTARBLOCK;
+    } else if (!strncmp(buffer, "#!/bin/bash", strlen("#!/bin/bash")) ||
+               !strncmp(buffer, "#!/bin/sh", strlen("#!/bin/sh")) ||
+               !strncmp(buffer, "#!/bin/csh", strlen("#!/bin/csh")) ||
+               !strncmp(buffer, "#!/usr/bin/awk", strlen("#!/usr/bin/awk")) ||
+               !strcmp(ext, "bash") || !strcmp(ext, "tcl") ||
+               !strcmp(ext, "csh") || !strcmp(ext, "mpl") ||
+               !strcmp(ext, "mla") || !strcmp(ext, "ps1") ||
+               !strcmp(ext, "m") || !strcmp(ext, "r") || !strcmp(ext, "sh") ||
+               !strncmp(buffer, "#!/usr/bin/Rscript",
+                        strlen("#!/usr/bin/Rscript"))) {
+        syntax = SINGLEHASHINLINE | ANGLEHASHBLOCK;
+    } else if (!strncmp(buffer, "%PDF-", strlen("%PDF-"))) {
+        fprintf(stderr, "nctyping currently does not support pdf-to-text\n");
+        exit(-1);
+    } else {
+        syntax = 0;
+    }
+    return syntax;
+}
+
+/* toggles flags for comment fields using a syntax mask from commentType() */
+void markSyntax(unsigned short int syntax, const char *buffer, char *flags,
+                int size, bool ignoreComments) {
+    int i;
+    int comment_len = 0;
+    for (i = 0; i < size; i++) {
+        if (!ignoreComments) {
+            if (syntax & DOUBLESLASHINLINE && !comment_len) {
+                comment_len = commentLength(buffer, &i, "//", "\n");
+            }
+            if (syntax & SINGLEHASHINLINE && !comment_len) {
+                comment_len = commentLength(buffer, &i, "#", "\n");
+            }
+            if (syntax & SLASHSTARBLOCK && !comment_len) {
+                comment_len = commentLength(buffer, &i, "/*", "*/");
+            }
+            if (syntax & ANGLEHASHBLOCK && !comment_len) {
+                comment_len = commentLength(buffer, &i, "<#", "#>");
+            }
+            if (syntax & TRIPLESQUOTEBLOCK && !comment_len) {
+                comment_len = commentLength(buffer, &i, "'''", "'''");
+            }
+            if (syntax & TRIPLEDQUOTEBLOCK && !comment_len) {
+                comment_len = commentLength(buffer, &i, "\"\"\"", "\"\"\"");
+            }
+        }
+        if (comment_len) {
+            flags[i] |= COMMENT;
+            comment_len--;
+        }
+        /* Mark isolated white space as comments as well */
+        if (!comment_len && buffer[i] == '\n') {
+            comment_len = strspn(buffer + (i + 1), " \n\t");
+        }
+        if (!comment_len && buffer[i] == ' ') {
+            comment_len = strspn(buffer + (i + 1), " \n\t");
+        }
+    }
+}
+
+/* toggles flags for comment fields based on interpretation of the file lang */
+void markComments(char *filename, const char *buffer, char *flags, int size,
+                  bool ignoreComments) {
+    markSyntax(commentType(filename, buffer), buffer, flags, size,
+               ignoreComments);
+}
+
+/* fills the screen with the char filler, current_color only maintains state */
+void clearscreen(int height, int width, int current_color, int filler) {
+    if (current_color)
+        attroff(COLOR_PAIR(current_color));
+    int x, y;
+    for (x = 0; x < width; x++) {
+        for (y = 0; y < height; y++) {
+            mvaddch(y, x, filler);
+        }
+    }
+    if (current_color)
+        attron(COLOR_PAIR(current_color));
+}
+
+/* returns color pair for typed chars based on the time it took to type them */
+int colortiming(int flag) {
+    if (flag & MISTAKE1 && flag & MISTAKE2) {
+        return 7;
+    } else if (flag & MISTAKE2) {
+        return 6;
+    } else if (flag & MISTAKE1) {
+        return 5;
+    } else {
+        return 4;
+    }
+}
+
+/* copies one char from a file into position i of buffer if it is typeable
+ * and returns the position of the next char to be copied */
+int pop_char(int sub, char *buffer, char *flags, int i, int size) {
+    int j;
+    if (sub == '\n' || (sub > 31 && sub < 127)) {
+        if (sub == '\n') flags[i] |= NEWLINE;
+        buffer[i] = sub;
+        i++;
+    /* tabs are treated as 4 spaces */
+    } else if (sub == '\t') {
+        for (j = 0; j < 3 && i < size; j++) {
+            buffer[i] = ' ';
+            i++;
+        }
+    }
+    return i;
+}
+
+/* allocates buffer and flags from arena for length chars of which up to tabs
+ * are tabs that pop_char() expands, pass tabs = length when they can't be
+ * counted first.  flags are cleared, and buffer has room for the NUL the
+ * string functions in markSyntax need.  RETURNS: the size to pass to
+ * pop_char(), -1 if the arena is out of memory */
+int alloc_buffer(int length, int tabs, char **buffer, char **flags,
+                 struct arena *arena) {
+    int size = length + 3 * tabs;
+    *buffer = arena_alloc(arena, size + 1);
+    *flags = arena_alloc(arena, size);
+    if (!(*buffer) || !(*flags)) {
+        perror("Error allocating memory for file buffer");
+        return -1;
+    }
+    memset(*flags, 0, size);
+    return size;
+}
+
+/* reads typeable content from a file and populates the buffer for typing(),
+ * buffer and flags are allocated from the document arena */
+int file_pop(char *filename, char **buffer, char **flags,
+             struct arena *arena) {
+    FILE *fd;
+    int i = 0;
+    int size, tabs = 0;
+    fd = fopen(filename, "r");
+    if (fd == NULL) {
+        perror("Error opening file");
+        return i;
+    }
+
+    /* getting the file size */
+    if (strcmp(filename, "/dev/stdin")) {
+        fseek(fd, 0L, SEEK_END);
+        size = ftell(fd);
+        fseek(fd, 0L, SEEK_SET);
+
+        /* need to count tabs in order to account for them in size of buffer */
+        while (!feof(fd)) {
+            if (fgetc(fd) == '\t')
+                tabs++;
+        }
+        fseek(fd, 0L, SEEK_SET);
+    } else {
+    /* need a constant size for a stdin buffer because fseek isn't possible */
+        size = 1024 * 1024;
+    }
+
+    size = alloc_buffer(size, tabs, buffer, flags, arena);
+    if (size == -1) {
+        fclose(fd);
+        return i;
+    }
+
+    while (!feof(fd) && i < size) {
+        i = pop_char((char)fgetc(fd), *buffer, *flags, i, size);
+    }
+    (*buffer)[i] = '\0';
+    if (fclose(fd) == EOF) {
+        perror("Error closing file");
+    }
+    return i;
+}
+
+/* like file_pop() but only reads length bytes starting at offset */
+int range_pop(const char *filename, long offset, int length, char **buffer,
+              char **flags, struct arena *arena) {
+    FILE *fd;
+    int i = 0;
+    int n, sub, size;
+    fd = fopen(filename, "r");
+    if (fd == NULL) {
+        perror("Error opening file");
+        return i;
+    }
+    if (fseek(fd, offset, SEEK_SET) == -1) {
+        perror("Error seeking in file");
+        fclose(fd);
+        return i;
+    }
+
+    size = alloc_buffer(length, length, buffer, flags, arena);
+    if (size == -1) {
+        fclose(fd);
+        return i;
+    }
+
+    for (n = 0; n < length && (sub = fgetc(fd)) != EOF; n++) {
+        i = pop_char(sub, *buffer, *flags, i, size);
+    }
+    (*buffer)[i] = '\0';
+    if (fclose(fd) == EOF) {
+        perror("Error closing file");
+    }
+    return i;
+}
+
+/* LINE INDEX ******************************************************************
+ * Warm-ups type random passages out of a file of any size.  The offset of
+ * every line start is kept in a sidecar file next to it named
+ * .<name>.nctyping-lines, so a passage can be found and mapped without
+ * reading the rest of the file.  When the file's directory can't be written
+ * to, the sidecar goes in $HOME/.nctyping-lines instead, named after the
+ * file's absolute path:
+ *
+ *   line_header | uint64_t offsets[nlines]
+ *
+ * The sidecar is rebuilt whenever the size or mtime of the file changes,
+ * mtimes are compared to the nanosecond so quick edits aren't missed.
+ */
+
+struct line_header {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    uint64_t nlines;
+};
+
+/* a loaded sidecar, offsets points into map */
+struct line_index {
+    void *map;
+    size_t map_size;
+    uint64_t nlines;
+    const uint64_t *offsets;
+    uint64_t size;  /* size of the indexed file */
+};
+
+static const char line_magic[8] = "NCTLIN2";
+
+/* path of the sidecar for filename, the result needs to be free()d */
+char *line_index_path(const char *filename) {
+    const char *name = strrchr(filename, '/') ? strrchr(filename, '/') + 1
+                                              : filename;
+    char *path = malloc(strlen(filename) + strlen("/..nctyping-lines") + 1);
+    strncpy(path, filename, name - filename);
+    sprintf(path + (name - filename), ".%s.nctyping-lines", name);
+    return path;
+}
+
+/* path of the sidecar for filename, an absolute path, in linedir.  '/' and
+ * '%' are escaped the way URLs escape them so every file gets its own name.
+ * The result needs to be free()d */
+char *home_line_index_path(const char *linedir, const char *filename) {
+    char *path = malloc(strlen(linedir) + 3 * strlen(filename) + 2);
+    char *k = path + sprintf(path, "%s/", linedir);
+    for (; *filename; filename++) {
+        if (*filename == '/' || *filename == '%') {
+            k += sprintf(k, "%%%02X", *filename);
+        } else {
+            *k++ = *filename;
+        }
+    }
+    *k = '\0';
+    return path;
+}
+
+/* writes the sidecar for filename in one streaming pass, through a temporary
+ * file so a half written sidecar is never loaded.  Leaves reporting errors
+ * to the caller, which may still have somewhere else to put it */
+int build_line_index(const char *filename, const char *indexpath,
+                     const struct stat *st) {
+    struct line_header header;
+    char chunk[65536];
+    uint64_t pos = 0, offset = 0;
+    size_t len, j;
+    FILE *in, *out;
+    char *tmppath = malloc(strlen(indexpath) + strlen(".tmp") + 1);
+    strcpy(tmppath, indexpath);
+    strcat(tmppath, ".tmp");
+
+    in = fopen(filename, "r");
+    out = fopen(tmppath, "w");
+    if (!in || !out) {
+        if (in) fclose(in);
+        if (out) fclose(out);
+        free(tmppath);
+        return 0;
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, line_magic, sizeof(line_magic));
+    header.size = st->st_size;
+    header.mtime = st->st_mtim.tv_sec;
+    header.mtime_nsec = st->st_mtim.tv_nsec;
+    fwrite(&header, sizeof(header), 1, out);
+
+    fwrite(&offset, sizeof(offset), 1, out);
+    header.nlines = 1;
+    while ((len = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+        for (j = 0; j < len; j++) {
+            if (chunk[j] == '\n' && pos + j + 1 < header.size) {
+                offset = pos + j + 1;
+                fwrite(&offset, sizeof(offset), 1, out);
+                header.nlines++;
+            }
+        }
+        pos += len;
+    }
+    fclose(in);
+
+    /* the line count is only known at the end */
+    fseek(out, 0L, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    if (fclose(out) == EOF || rename(tmppath, indexpath) == -1) {
+        remove(tmppath);
+        free(tmppath);
+        return 0;
+    }
+    free(tmppath);
+    return 1;
+}
+
+/* maps the sidecar at indexpath if it is up to date with a file of stat st */
+int map_line_index(const char *indexpath, const struct stat *st,
+                   struct line_index *index) {
+    struct line_header *header;
+    struct stat ist;
+    void *map;
+    int fd = open(indexpath, O_RDONLY);
+    if (fd == -1) return 0;
+    if (fstat(fd, &ist) == -1 || ist.st_size < sizeof(struct line_header)) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+    header = map;
+    if (memcmp(header->magic, line_magic, sizeof(line_magic)) ||
+        header->size != st->st_size || header->mtime != st->st_mtim.tv_sec ||
+        header->mtime_nsec != st->st_mtim.tv_nsec ||
+        ist.st_size != sizeof(struct line_header) +
+                       header->nlines * sizeof(uint64_t)) {
+        munmap(map, ist.st_size);
+        return 0;
+    }
+    index->map = map;
+    index->map_size = ist.st_size;
+    index->nlines = header->nlines;
+    index->offsets = (const uint64_t *)(header + 1);
+    index->size = st->st_size;
+    return 1;
+}
+
+/* maps the sidecar of filename, building it first if it is missing or stale.
+ * The one next to the file is preferred, the one in linedir (if not NULL) is
+ * used when the file's directory is read-only */
+int load_line_index(const char *filename, const char *linedir,
+                    struct line_index *index) {
+    struct stat st;
+    char *paths[2];
+    int npaths = 1, k, found = 0;
+
+    if (stat(filename, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "Unable to sample empty or missing file %s\n",
+                filename);
+        return 0;
+    }
+    paths[0] = line_index_path(filename);
+    if (linedir) {
+        mkdir(linedir, 0755);
+        paths[npaths++] = home_line_index_path(linedir, filename);
+    }
+    for (k = 0; k < npaths && !found; k++) {
+        found = map_line_index(paths[k], &st, index);
+    }
+    for (k = 0; k < npaths && !found; k++) {
+        found = build_line_index(filename, paths[k], &st) &&
+                map_line_index(paths[k], &st, index);
+    }
+    if (!found) perror("Error creating line index");
+    for (k = 0; k < npaths; k++) {
+        free(paths[k]);
+    }
+    return found;
+}
+
+/* loads the passage of WARMUP_LINES lines starting at line into a buffer for
+ * typing(), mapping only the pages around it.  Up to WARMUP_CONTEXT bytes of
+ * the lines before the passage are loaded as well so comments that started
+ * there are still marked, *begin is where the passage starts in buffer */
+int sample_pop(const char *filename, const struct line_index *index,
+               uint64_t line, int *begin, char **buffer, char **flags,
+               struct arena *arena) {
+    char head[128];
+    uint64_t first = line, last, start, end, page, k;
+    const char *data;
+    int i = 0;
+    int size, len, fd;
+
+    /* widen the window back to earlier line starts for comment context */
+    while (first > 0 &&
+           index->offsets[line] - index->offsets[first - 1] <= WARMUP_CONTEXT)
+        first--;
+    last = line + WARMUP_LINES < index->nlines ? line + WARMUP_LINES
+                                                : index->nlines;
+    start = index->offsets[first];
+    end = last < index->nlines ? index->offsets[last] : index->size;
+    if (end - index->offsets[line] > 2 * PASSAGE_SIZE)
+        end = index->offsets[line] + 2 * PASSAGE_SIZE;
+
+    fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening file");
+        return i;
+    }
+    /* shebangs are only at the very start of the file */
+    len = pread(fd, head, sizeof(head) - 1, 0);
+    head[len > 0 ? len : 0] = '\0';
+    page = start - start % sysconf(_SC_PAGESIZE);
+    data = mmap(NULL, end - page, PROT_READ, MAP_PRIVATE, fd, page);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error mapping file");
+        return i;
+    }
+
+    size = alloc_buffer(end - start, end - start, buffer, flags, arena);
+    if (size == -1) {
+        munmap((void *)data, end - page);
+        return i;
+    }
+    for (k = start; k < end; k++) {
+        if (k == index->offsets[line]) *begin = i;
+        i = pop_char(data[k - page], *buffer, *flags, i, size);
+    }
+    (*buffer)[i] = '\0';
+    munmap((void *)data, end - page);
+
+    markSyntax(commentType((char *)filename, head), *buffer, *flags, i, false);
+    return i;
+}
+
+/* TREE WALK *******************************************************************
+ * Directory mode streams every text file under a directory into the session.
+ * WALK_THREADS workers read directories off a shared stack while the user
+ * is already typing the first files, so nothing has to be stat-ed before the
+ * session starts.  Each directory read becomes a node holding its sorted
+ * files and subdirectories, and files are only moved into the manifest by
+ * walking the nodes depth first in that order, so the manifest order is the
+ * same on every run however the workers happen to finish.  Subdirectories
+ * are pushed last first, so the workers read directories in about the order
+ * the manifest needs them and the first files show up right away.
+ */
+
+/* one typeable file found by the walk */
+struct manifest_entry {
+    char *path;
+    long long bytes;
+    unsigned short int syntax;  /* comment syntax mask from commentType() */
+};
+
+/* files found so far, entries are only ever appended so an index into
+ * entries stays valid while the walk goes on */
+struct manifest {
+    struct manifest_entry *entries;
+    int count;
+    int capacity;
+    bool done;
+};
+
+/* one directory of the walk, items is only filled in once it is scanned */
+struct walk_node {
+    char *path;
+    bool scanned;
+    struct walk_item *items;
+    int nitems;
+};
+
+/* a file or a subdirectory of a walk_node, in sorted order */
+struct walk_item {
+    struct walk_node *dir;        /* NULL for files */
+    struct manifest_entry file;
+};
+
+/* how far the manifest has got through a node, see publish_walk() */
+struct walk_cursor {
+    struct walk_node *node;
+    int next;
+};
+
+/* state shared by the walk threads, everything is guarded by lock */
+struct tree_walk {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    pthread_t threads[WALK_THREADS];
+    int nthreads;
+    char *root;
+    char **ignores;   /* patterns from the root .gitignore */
+    int nignores;
+    struct walk_node **todo;  /* directories waiting to be read, the one
+                               * the manifest needs first on top */
+    int ntodo;
+    int todo_capacity;
+    int pending;      /* directories waiting or being read */
+    struct walk_cursor *stack;  /* path from the root to the node the
+                                 * manifest is waiting on */
+    int depth;
+    int stack_capacity;
+    bool cancelled;   /* set when the session ends before the walk does */
+    struct manifest manifest;
+};
+
+/* reads the patterns of the .gitignore at the root of the walk, negations
+ * are not supported and are skipped */
+void load_ignores(struct tree_walk *walk) {
+    FILE *fd;
+    char line[256];
+    char *pattern;
+    int len;
+    int capacity = 0;
+    char *path = malloc(strlen(walk->root) + strlen("/.gitignore") + 1);
+    strcpy(path, walk->root);
+    strcat(path, "/.gitignore");
+    fd = fopen(path, "r");
+    free(path);
+    if (!fd) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fd)) {
+        len = strcspn(line, "\r\n");
+        line[len] = '\0';
+        if (!len || line[0] == '#' || line[0] == '!') continue;
+        pattern = line;
+        /* a trailing slash only matches directories, which we treat alike */
+        if (pattern[len - 1] == '/') pattern[--len] = '\0';
+        if (pattern[0] == '/') pattern++;
+        if (!*pattern) continue;
+        if (walk->nignores == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            walk->ignores = realloc(walk->ignores, capacity * sizeof(char *));
+        }
+        walk->ignores[walk->nignores] = malloc(strlen(pattern) + 1);
+        strcpy(walk->ignores[walk->nignores], pattern);
+        walk->nignores++;
+    }
+    fclose(fd);
+}
+
+/* whether path (with name as its last component) should be left out */
+bool is_ignored(const struct tree_walk *walk, const char *path,
+                const char *name) {
+    const char *relative = path + strlen(walk->root) + 1;
+    int i;
+    /* hidden files and directories such as .git are always skipped */
+    if (name[0] == '.') return true;
+    for (i = 0; i < walk->nignores; i++) {
+        if (strchr(walk->ignores[i], '/')) {
+            if (!fnmatch(walk->ignores[i], relative, FNM_PATHNAME))
+                return true;
+        } else if (!fnmatch(walk->ignores[i], name, 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* opens a file found by the walk and fills in entry with its size and
+ * comment syntax, returns false for binaries and unreadable files */
+bool walk_file(char *path, struct manifest_entry *entry) {
+    struct stat st;
+    char head[4096];
+    int len;
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    len = read(fd, head, sizeof(head) - 1);
+    if (len <= 0 || fstat(fd, &st) == -1 || memchr(head, 0, len) ||
+        !strncmp(head, "%PDF-", strlen("%PDF-"))) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+    head[len] = '\0';
+    entry->path = path;
+    entry->bytes = st.st_size;
+    entry->syntax = commentType(path, head);
+    return true;
+}
+
+/* frees a node and everything under it from item first on */
+void free_walk_node(struct walk_node *node, int first) {
+    int i;
+    for (i = first; i < node->nitems; i++) {
+        if (node->items[i].dir) {
+            free_walk_node(node->items[i].dir, 0);
+        } else {
+            free(node->items[i].file.path);
+        }
+    }
+    free(node->items);
+    free(node->path);
+    free(node);
+}
+
+/* moves every file that is next in depth first order into the manifest,
+ * stopping at the first directory that hasn't been scanned yet.  The lock
+ * must be held */
+void publish_walk(struct tree_walk *walk) {
+    struct manifest *manifest = &walk->manifest;
+    struct walk_cursor *top;
+    struct walk_item *item;
+    while (walk->depth) {
+        top = &walk->stack[walk->depth - 1];
+        if (!top->node->scanned) break;
+        if (top->next == top->node->nitems) {
+            /* files moved to the manifest, directories are on the stack */
+            top->node->nitems = 0;
+            free_walk_node(top->node, 0);
+            walk->depth--;
+            continue;
+        }
+        item = &top->node->items[top->next++];
+        if (item->dir) {
+            if (walk->depth == walk->stack_capacity) {
+                walk->stack_capacity *= 2;
+                walk->stack = realloc(walk->stack, walk->stack_capacity *
+                                      sizeof(struct walk_cursor));
+            }
+            walk->stack[walk->depth].node = item->dir;
+            walk->stack[walk->depth].next = 0;
+            walk->depth++;
+            continue;
+        }
+        if (manifest->count == manifest->capacity) {
+            manifest->capacity = manifest->capacity ? manifest->capacity * 2
+                                                    : 64;
+            manifest->entries = realloc(manifest->entries, manifest->capacity *
+                                        sizeof(struct manifest_entry));
+        }
+        manifest->entries[manifest->count++] = item->file;
+    }
+    if (!walk->depth) manifest->done = true;
+    pthread_cond_broadcast(&walk->changed);
+}
+
+/* reads one directory into node, pushing its subdirectories so the first
+ * one is read next */
+void walk_dir(struct tree_walk *walk, struct walk_node *node) {
+    struct dirent **entries;
+    struct walk_item *items = NULL;
+    struct stat st;
+    char *path;
+    bool isDir, isFile;
+    int n, i, nitems = 0;
+
+    /* alphasort keeps siblings in the same order on every run */
+    n = scandir(node->path, &entries, NULL, alphasort);
+    if (n > 0) items = malloc(n * sizeof(struct walk_item));
+    for (i = 0; i < n; i++) {
+        path = malloc(strlen(node->path) + strlen(entries[i]->d_name) + 2);
+        sprintf(path, "%s/%s", node->path, entries[i]->d_name);
+        if (is_ignored(walk, path, entries[i]->d_name)) {
+            free(path);
+            free(entries[i]);
+            continue;
+        }
+        /* only fall back to stat() when the filesystem doesn't give types */
+        if (entries[i]->d_type == DT_UNKNOWN) {
+            if (stat(path, &st) == -1) st.st_mode = 0;
+            isDir = S_ISDIR(st.st_mode);
+            isFile = S_ISREG(st.st_mode);
+        } else {
+            isDir = entries[i]->d_type == DT_DIR;
+            isFile = entries[i]->d_type == DT_REG;
+        }
+        if (isDir) {
+            items[nitems].dir = calloc(1, sizeof(struct walk_node));
+            items[nitems].dir->path = path;
+            nitems++;
+        } else if (isFile && walk_file(path, &items[nitems].file)) {
+            items[nitems].dir = NULL;
+            nitems++;
+        } else {
+            free(path);
+        }
+        free(entries[i]);
+    }
+    if (n >= 0) free(entries);
+
+    pthread_mutex_lock(&walk->lock);
+    node->items = items;
+    node->nitems = nitems;
+    node->scanned = true;
+    for (i = nitems - 1; i >= 0; i--) {
+        if (!items[i].dir) continue;
+        if (walk->ntodo == walk->todo_capacity) {
+            walk->todo_capacity *= 2;
+            walk->todo = realloc(walk->todo, walk->todo_capacity *
+                                 sizeof(struct walk_node *));
+        }
+        walk->todo[walk->ntodo++] = items[i].dir;
+        walk->pending++;
+    }
+    publish_walk(walk);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+/* body of each walk thread, runs until no directories are left anywhere */
+void *walk_thread(void *arg) {
+    struct tree_walk *walk = arg;
+    struct walk_node *node;
+    pthread_mutex_lock(&walk->lock);
+    while (walk->pending) {
+        /* drop whatever is still waiting once nobody wants the files, the
+         * nodes themselves are freed with the rest of the tree */
+        if (walk->cancelled) {
+            walk->pending -= walk->ntodo;
+            walk->ntodo = 0;
+        }
+        if (!walk->pending) break;
+        if (!walk->ntodo) {
+            pthread_cond_wait(&walk->changed, &walk->lock);
+            continue;
+        }
+        node = walk->todo[--walk->ntodo];
+        pthread_mutex_unlock(&walk->lock);
+        walk_dir(walk, node);
+        pthread_mutex_lock(&walk->lock);
+        walk->pending--;
+    }
+    walk->manifest.done = true;
+    pthread_cond_broadcast(&walk->changed);
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+/* frees the manifest of a finished walk */
+void free_manifest(struct manifest *manifest) {
+    int i;
+    for (i = 0; i < manifest->count; i++) {
+        free(manifest->entries[i].path);
+    }
+    free(manifest->entries);
+}
+
+/* waits for the walk threads and frees everything but the manifest
+ * cancel: whether to stop walking instead of waiting for the whole tree */
+void finish_walk(struct tree_walk *walk, bool cancel) {
+    int i;
+    if (cancel) {
+        pthread_mutex_lock(&walk->lock);
+        walk->cancelled = true;
+        pthread_cond_broadcast(&walk->changed);
+        pthread_mutex_unlock(&walk->lock);
+    }
+    for (i = 0; i < walk->nthreads; i++) {
+        pthread_join(walk->threads[i], NULL);
+    }
+    /* a cancelled walk leaves nodes the manifest never got to */
+    while (walk->depth) {
+        walk->depth--;
+        free_walk_node(walk->stack[walk->depth].node,
+                       walk->stack[walk->depth].next);
+    }
+    for (i = 0; i < walk->nignores; i++) {
+        free(walk->ignores[i]);
+    }
+    free(walk->ignores);
+    free(walk->todo);
+    free(walk->stack);
+    free(walk->root);
+    pthread_cond_destroy(&walk->changed);
+    pthread_mutex_destroy(&walk->lock);
+}
+
+/* starts walking root in the background, root should be an absolute path */
+int start_walk(struct tree_walk *walk, const char *root) {
+    struct walk_node *node;
+    memset(walk, 0, sizeof(struct tree_walk));
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->changed, NULL);
+    walk->root = malloc(strlen(root) + 1);
+    strcpy(walk->root, root);
+    /* drop trailing slashes so paths relative to root can be found */
+    while (strlen(walk->root) > 1 && walk->root[strlen(walk->root) - 1] == '/')
+        walk->root[strlen(walk->root) - 1] = '\0';
+    load_ignores(walk);
+
+    node = calloc(1, sizeof(struct walk_node));
+    node->path = malloc(strlen(walk->root) + 1);
+    strcpy(node->path, walk->root);
+    walk->todo_capacity = 64;
+    walk->todo = malloc(walk->todo_capacity * sizeof(struct walk_node *));
+    walk->todo[0] = node;
+    walk->ntodo = 1;
+    walk->pending = 1;
+    walk->stack_capacity = 16;
+    walk->stack = malloc(walk->stack_capacity * sizeof(struct walk_cursor));
+    walk->stack[0].node = node;
+    walk->stack[0].next = 0;
+    walk->depth = 1;
+    for (walk->nthreads = 0; walk->nthreads < WALK_THREADS;
+         walk->nthreads++) {
+        if (pthread_create(&walk->threads[walk->nthreads], NULL, walk_thread,
+                           walk)) {
+            perror("Error starting directory walk");
+            /* the threads already running still use walk */
+            finish_walk(walk, true);
+            free_manifest(&walk->manifest);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* blocks until the manifest has an entry n or the walk is over, copying the
+ * entry since the manifest may grow, returns false if there is no entry n */
+bool walk_entry(struct tree_walk *walk, int n, struct manifest_entry *entry) {
+    bool found = false;
+    pthread_mutex_lock(&walk->lock);
+    while (walk->manifest.count <= n && !walk->manifest.done) {
+        pthread_cond_wait(&walk->changed, &walk->lock);
+    }
+    if (n < walk->manifest.count) {
+        *entry = walk->manifest.entries[n];
+        found = true;
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return found;
+}
+
+/* N-GRAM INDEX ****************************************************************
+ * Drill mode picks passages from a corpus directory that are richest in the
+ * n-grams the user mistypes most.  The index is built once per directory and
+ * stored at <dir>/.nctyping-ngrams, laid out so it can be mmapped as is:
+ *
+ *   ngram_header | uint64_t table[NGRAM_BUCKETS + 1] | ngram_file files[] |
+ *   ngram_passage passages[] | file names | ngram_posting postings[]
+ *
+ * table[b] to table[b + 1] is the range of postings listing the (at most
+ * NGRAM_POSTINGS) passages with the most of n-gram bucket b, and how many
+ * times it appears there.  File names are relative to the corpus directory
+ * so the corpus can be moved, and the size and mtime of every file are kept
+ * so the index is rebuilt once a file that is drilled has changed.
+ */
+
+struct ngram_header {
+    char magic[8];
+    uint32_t npassages;
+    uint32_t nfiles;
+    uint64_t npostings;
+    uint64_t names_size;  /* padded so postings stay aligned */
+};
+
+struct ngram_posting {
+    uint32_t passage;
+    uint32_t count;
+};
+
+/* a corpus file as it was when the index was built */
+struct ngram_file {
+    uint64_t name;    /* offset of the file name in the names section */
+    uint64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;  /* so edits within the same second are noticed */
+};
+
+struct ngram_passage {
+    uint64_t offset;  /* offset of the passage in its file */
+    uint32_t file;
+    uint32_t length;
+};
+
+/* a loaded index, every pointer points into map */
+struct ngram_index {
+    void *map;
+    size_t map_size;
+    const struct ngram_header *header;
+    const uint64_t *table;
+    const struct ngram_file *files;
+    const struct ngram_passage *passages;
+    const char *names;
+    const struct ngram_posting *postings;
+};
+
+/* everything build_ngram_index() allocates, so it is freed in one place */
+struct ngram_build {
+    struct manifest manifest;
+    struct ngram_file *files;
+    int *entries;       /* manifest entry of each indexed file */
+    uint32_t *first;    /* first passage of each indexed file */
+    char *names;
+    uint64_t *table;
+    uint64_t *filled;   /* postings of each bucket filled in so far */
+    uint32_t *counts;
+    uint64_t nfiles;
+    uint64_t npassages;
+    uint64_t names_size;
+};
+
+static const char ngram_magic[8] = "NCTNGR3";
+
+/* maps a char onto the n-gram alphabet, -1 if it can't be part of a n-gram */
+int ngram_char(int c) {
+    if (c == '\n') return 0;
+    if (c == '\t') c = ' ';
+    if (c > 31 && c < 127) return c - 31;
+    return -1;
+}
+
+/* maps a whole file read-only, NULL if it can't be read or looks binary.
+ * st is filled in with the file's stat */
+const char *map_file(const char *filename, struct stat *st) {
+    const char *data;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) return NULL;
+    if (fstat(fd, st) == -1 || st->st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    /* text files don't have NUL bytes near the start */
+    if (memchr(data, 0, st->st_size < 4096 ? st->st_size : 4096)) {
+        munmap((void *)data, st->st_size);
+        return NULL;
+    }
+    return data;
+}
+
+/* passages start at the beginning of a line and end after the first newline
+ * past PASSAGE_SIZE, or at twice that for files with very long lines.  A
+ * short tail of a file is folded into the passage before it */
+size_t passage_end(const char *data, size_t size, size_t start) {
+    size_t end = start + PASSAGE_SIZE;
+    size_t limit = start + 2 * PASSAGE_SIZE;
+    if (end >= size) return size;
+    if (limit >= size && size - start < PASSAGE_SIZE + PASSAGE_SIZE / 2)
+        return size;
+    if (limit > size) limit = size;
+    while (end < limit && data[end - 1] != '\n') end++;
+    return end;
+}
+
+/* counts the bigrams and trigrams of text into counts, recording each bucket
+ * the first time it is seen in touched so counts can be cleared cheaply */
+int count_ngrams(const char *text, size_t len, uint32_t *counts,
+                 uint32_t *touched) {
+    int ntouched = 0;
+    int a = -1, b = -1, c;
+    uint32_t bucket;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        c = ngram_char(text[i]);
+        if (c != -1 && b != -1) {
+            bucket = b * NGRAM_ALPHABET + c;
+            if (counts[bucket]++ == 0) touched[ntouched++] = bucket;
+            if (a != -1) {
+                bucket = NGRAM_BIGRAMS +
+                         (a * NGRAM_ALPHABET + b) * NGRAM_ALPHABET + c;
+                if (counts[bucket]++ == 0) touched[ntouched++] = bucket;
+            }
+        }
+        a = b;
+        b = c;
+    }
+    return ntouched;
+}
+
+/* first pass over the corpus: records every readable file and counts the
+ * postings of each n-gram bucket into table[bucket + 1] */
+void size_ngram_index(struct ngram_build *build, size_t rootlen) {
+    struct manifest_entry *entry;
+    struct stat st;
+    uint32_t touched[4 * PASSAGE_SIZE];
+    size_t start, end;
+    const char *data;
+    uint32_t p = 0;
+    int f, n, t;
+
+    for (f = 0; f < build->manifest.count; f++) {
+        entry = &build->manifest.entries[f];
+        data = map_file(entry->path, &st);
+        if (!data) continue;
+        build->files[build->nfiles].name = build->names_size;
+        build->files[build->nfiles].size = st.st_size;
+        build->files[build->nfiles].mtime = st.st_mtim.tv_sec;
+        build->files[build->nfiles].mtime_nsec = st.st_mtim.tv_nsec;
+        build->entries[build->nfiles] = f;
+        build->first[build->nfiles] = p;
+        build->nfiles++;
+        strcpy(build->names + build->names_size, entry->path + rootlen);
+        build->names_size += strlen(entry->path + rootlen) + 1;
+        for (start = 0; start < st.st_size; start = end) {
+            end = passage_end(data, st.st_size, start);
+            n = count_ngrams(data + start, end - start, build->counts,
+                             touched);
+            for (t = 0; t < n; t++) {
+                build->table[touched[t] + 1]++;
+                build->counts[touched[t]] = 0;
+            }
+            p++;
+        }
+        munmap((void *)data, st.st_size);
+    }
+    build->first[build->nfiles] = p;
+    build->npassages = p;
+    /* names are followed by the postings, keep those aligned */
+    build->names_size = (build->names_size + 7) & ~(uint64_t)7;
+}
+
+/* most occurrences first, ties by passage so builds are reproducible */
+int compare_postings(const void *a, const void *b) {
+    const struct ngram_posting *x = a, *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return (x->passage > y->passage) - (x->passage < y->passage);
+}
+
+/* adds posting to the postings of one bucket if it is among the capacity
+ * richest seen so far.  They are kept as a heap of *n postings with the
+ * poorest on top, so it can be dropped when a richer one comes along */
+void offer_posting(struct ngram_posting *heap, uint64_t *n,
+                   uint64_t capacity, struct ngram_posting posting) {
+    uint64_t i, child;
+    if (*n < capacity) {
+        for (i = (*n)++; i && compare_postings(&heap[(i - 1) / 2],
+                                                &posting) < 0;
+             i = (i - 1) / 2) {
+            heap[i] = heap[(i - 1) / 2];
+        }
+        heap[i] = posting;
+        return;
+    }
+    if (!capacity || compare_postings(&posting, heap) >= 0) return;
+    for (i = 0; (child = 2 * i + 1) < *n; i = child) {
+        if (child + 1 < *n && compare_postings(&heap[child + 1],
+                                               &heap[child]) > 0)
+            child++;
+        if (compare_postings(&heap[child], &posting) <= 0) break;
+        heap[i] = heap[child];
+    }
+    heap[i] = posting;
+}
+
+/* second pass over the corpus: fills in the passages and offers every
+ * posting to its bucket, which only has room for the NGRAM_POSTINGS richest
+ * so the index is never bigger on disk than it ends up */
+void fill_ngram_index(struct ngram_build *build,
+                      struct ngram_passage *passages,
+                      struct ngram_posting *postings) {
+    struct stat st;
+    uint32_t touched[4 * PASSAGE_SIZE];
+    struct ngram_posting posting;
+    uint64_t *table = build->table;
+    size_t start, end;
+    const char *data;
+    uint32_t p, i;
+    int n, t;
+
+    for (i = 0; i < build->nfiles; i++) {
+        for (p = build->first[i]; p < build->first[i + 1]; p++) {
+            passages[p].file = i;
+        }
+        data = map_file(build->manifest.entries[build->entries[i]].path, &st);
+        if (data && (st.st_size != build->files[i].size ||
+                     st.st_mtim.tv_sec != build->files[i].mtime ||
+                     st.st_mtim.tv_nsec != build->files[i].mtime_nsec)) {
+            munmap((void *)data, st.st_size);
+            data = NULL;
+        }
+        if (!data) {
+            /* changed since the first pass: leave its passages empty, it is
+             * indexed again the next time the index is rebuilt */
+            build->files[i].mtime = -1;
+            continue;
+        }
+        p = build->first[i];
+        for (start = 0; start < st.st_size; start = end) {
+            end = passage_end(data, st.st_size, start);
+            n = count_ngrams(data + start, end - start, build->counts,
+                             touched);
+            for (t = 0; t < n; t++) {
+                posting.passage = p;
+                posting.count = build->counts[touched[t]];
+                offer_posting(postings + table[touched[t]],
+                              &build->filled[touched[t]],
+                              table[touched[t] + 1] - table[touched[t]],
+                              posting);
+                build->counts[touched[t]] = 0;
+            }
+            passages[p].offset = start;
+            passages[p].length = end - start;
+            p++;
+        }
+        munmap((void *)data, st.st_size);
+    }
+}
+
+/* sorts the postings of every bucket richest first, closing the gaps left
+ * by files that changed mid build.  RETURNS: how many postings are left */
+uint64_t sort_postings(uint64_t *table, const uint64_t *filled,
+                       struct ngram_posting *postings) {
+    uint64_t from, k, kept = 0;
+    int t;
+    for (t = 0; t < NGRAM_BUCKETS; t++) {
+        from = table[t];
+        qsort(postings + from, filled[t], sizeof(struct ngram_posting),
+              compare_postings);
+        table[t] = kept;
+        for (k = from; k < from + filled[t]; k++) {
+            postings[kept++] = postings[k];
+        }
+    }
+    table[NGRAM_BUCKETS] = kept;
+    return kept;
+}
+
+/* writes the index to path by mapping it at its full size and filling it in,
+ * it is only truncated when files changed mid build */
+int write_ngram_index(struct ngram_build *build, const char *path) {
+    struct ngram_header *header;
+    struct ngram_passage *passages;
+    struct ngram_posting *postings;
+    size_t offset, map_size;
+    char *map;
+    int t, fd;
+
+    /* turn the posting counts into offsets into postings, leaving room for
+     * at most NGRAM_POSTINGS per bucket */
+    for (t = 0; t < NGRAM_BUCKETS; t++) {
+        if (build->table[t + 1] > NGRAM_POSTINGS)
+            build->table[t + 1] = NGRAM_POSTINGS;
+        build->table[t + 1] += build->table[t];
+    }
+
+    offset = sizeof(struct ngram_header) +
+             (NGRAM_BUCKETS + 1) * sizeof(uint64_t) +
+             build->nfiles * sizeof(struct ngram_file) +
+             build->npassages * sizeof(struct ngram_passage) +
+             build->names_size;
+    map_size = offset +
+               build->table[NGRAM_BUCKETS] * sizeof(struct ngram_posting);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, map_size) == -1) {
+        perror("Error creating n-gram index");
+        if (fd != -1) close(fd);
+        return 0;
+    }
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("Error mapping n-gram index");
+        close(fd);
+        return 0;
+    }
+    passages = (struct ngram_passage *)(map + sizeof(struct ngram_header) +
+               (NGRAM_BUCKETS + 1) * sizeof(uint64_t) +
+               build->nfiles * sizeof(struct ngram_file));
+    postings = (struct ngram_posting *)(map + offset);
+    fill_ngram_index(build, passages, postings);
+    offset += sort_postings(build->table, build->filled, postings) *
+              sizeof(struct ngram_posting);
+
+    header = (struct ngram_header *)map;
+    memcpy(header->magic, ngram_magic, sizeof(ngram_magic));
+    header->npassages = build->npassages;
+    header->nfiles = build->nfiles;
+    header->npostings = build->table[NGRAM_BUCKETS];
+    header->names_size = build->names_size;
+    memcpy(header + 1, build->table, (NGRAM_BUCKETS + 1) * sizeof(uint64_t));
+    memcpy(map + sizeof(struct ngram_header) +
+           (NGRAM_BUCKETS + 1) * sizeof(uint64_t), build->files,
+           build->nfiles * sizeof(struct ngram_file));
+    memcpy(passages + build->npassages, build->names, build->names_size);
+    munmap(map, map_size);
+    if (ftruncate(fd, offset) == -1 || close(fd) == -1) {
+        perror("Error writing n-gram index");
+        return 0;
+    }
+    return 1;
+}
+
+/* builds the n-gram index for every file the walk of dir finds in two passes
+ * over the corpus: the first sizes each posting list, the second fills them
+ * in directly in the mmapped index file so memory use doesn't grow with it */
+int build_ngram_index(const char *dir, const char *indexpath) {
+    struct tree_walk walk;
+    struct ngram_build build;
+    size_t rootlen = strlen(dir), names_size = 0;
+    char *tmppath;
+    int f, res = 0;
+
+    if (!start_walk(&walk, dir)) return 0;
+    finish_walk(&walk, false);
+    /* the walk names files as <dir>/<name>, without trailing slashes */
+    while (rootlen > 1 && dir[rootlen - 1] == '/') rootlen--;
+    rootlen++;
+    memset(&build, 0, sizeof(build));
+    build.manifest = walk.manifest;
+    for (f = 0; f < build.manifest.count; f++) {
+        names_size += strlen(build.manifest.entries[f].path + rootlen) + 1;
+    }
+    build.files = malloc((build.manifest.count + 1) *
+                         sizeof(struct ngram_file));
+    build.entries = malloc((build.manifest.count + 1) * sizeof(int));
+    build.first = malloc((build.manifest.count + 1) * sizeof(uint32_t));
+    /* padding the names may need up to 7 bytes past the last one */
+    build.names = calloc(names_size + 8, 1);
+    build.table = calloc(NGRAM_BUCKETS + 1, sizeof(uint64_t));
+    build.filled = calloc(NGRAM_BUCKETS, sizeof(uint64_t));
+    build.counts = calloc(NGRAM_BUCKETS, sizeof(uint32_t));
+    tmppath = malloc(strlen(indexpath) + strlen(".tmp") + 1);
+    if (!build.files || !build.entries || !build.first || !build.names ||
+        !build.table || !build.filled || !build.counts || !tmppath) {
+        perror("Error allocating memory for n-gram index");
+    } else {
+        strcpy(tmppath, indexpath);
+        strcat(tmppath, ".tmp");
+        size_ngram_index(&build, rootlen);
+        if (write_ngram_index(&build, tmppath)) {
+            if (rename(tmppath, indexpath) == -1) {
+                perror("Error writing n-gram index");
+            } else {
+                res = 1;
+            }
+        }
+    }
+
+    free_manifest(&build.manifest);
+    free(build.files);
+    free(build.entries);
+    free(build.first);
+    free(build.names);
+    free(build.table);
+    free(build.filled);
+    free(build.counts);
+    free(tmppath);
+    return res;
+}
+
+/* maps the index at indexpath.  RETURNS: 0 if it is missing or doesn't look
+ * like an index */
+int load_ngram_index(const char *indexpath, struct ngram_index *index) {
+    struct stat st;
+    const char *map;
+    int fd = open(indexpath, O_RDONLY);
+    if (fd == -1) return 0;
+    if (fstat(fd, &st) == -1 ||
+        st.st_size < sizeof(struct ngram_header) +
+                     (NGRAM_BUCKETS + 1) * sizeof(uint64_t)) {
+        close(fd);
+        return 0;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 0;
+
+    index->map = (void *)map;
+    index->map_size = st.st_size;
+    index->header = (const struct ngram_header *)map;
+    index->table = (const uint64_t *)(map + sizeof(struct ngram_header));
+    index->files = (const struct ngram_file *)(index->table +
+                                               NGRAM_BUCKETS + 1);
+    index->passages = (const struct ngram_passage *)(index->files +
+                                                     index->header->nfiles);
+    index->names = (const char *)(index->passages + index->header->npassages);
+    index->postings = (const struct ngram_posting *)(index->names +
+                                                     index->header->names_size);
+    if (memcmp(index->header->magic, ngram_magic, sizeof(ngram_magic)) ||
+        (const char *)(index->postings + index->header->npostings) !=
+            map + st.st_size) {
+        munmap(index->map, index->map_size);
+        return 0;
+    }
+    return 1;
+}
+
+/* whether the corpus file at path is still as it was when indexed */
+bool ngram_file_fresh(const struct ngram_file *file, const char *path) {
+    struct stat st;
+    return stat(path, &st) != -1 && st.st_size == file->size &&
+           st.st_mtim.tv_sec == file->mtime &&
+           st.st_mtim.tv_nsec == file->mtime_nsec;
+}
+
+/* adds the n-grams ending at every mistyped char between begin and end to
+ * the weakness table, weighted by how many times that char was missed */
+void record_weakness(const char *buffer, const char *flags, int begin,
+                     int end, int *weak) {
+    int i, a, b, c, missed;
+    for (i = begin < 1 ? 1 : begin; i < end; i++) {
+        missed = (flags[i] & (MISTAKE1 | MISTAKE2)) / MISTAKE1;
+        if (!missed || flags[i - 1] & COMMENT) continue;
+        b = ngram_char(buffer[i - 1]);
+        c = ngram_char(buffer[i]);
+        if (b == -1 || c == -1) continue;
+        weak[b * NGRAM_ALPHABET + c] += missed;
+        if (i < 2 || flags[i - 2] & COMMENT) continue;
+        a = ngram_char(buffer[i - 2]);
+        if (a == -1) continue;
+        weak[NGRAM_BIGRAMS + (a * NGRAM_ALPHABET + b) * NGRAM_ALPHABET + c] +=
+            missed;
+    }
+}
+
+/* reads the weakness table saved at weakpath as "bucket weight" lines */
+int *load_weakness(const char *weakpath) {
+    FILE *fd;
+    int bucket, weight;
+    int *weak = calloc(NGRAM_BUCKETS, sizeof(int));
+    if (!weak) {
+        perror("Error allocating memory for weakness table");
+        return NULL;
+    }
+    fd = fopen(weakpath, "r");
+    if (!fd) {
+        return weak;
+    }
+    while (fscanf(fd, "%d %d", &bucket, &weight) == 2) {
+        if (bucket >= 0 && bucket < NGRAM_BUCKETS) weak[bucket] = weight;
+    }
+    fclose(fd);
+    return weak;
+}
+
+/* writes every n-gram the user has missed at least once to weakpath */
+int save_weakness(const int *weak, const char *weakpath) {
+    FILE *fd;
+    int bucket;
+    fd = fopen(weakpath, "w");
+    if (!fd) {
+        return 0;
+    }
+    for (bucket = 0; bucket < NGRAM_BUCKETS; bucket++) {
+        if (weak[bucket]) fprintf(fd, "%d %d\n", bucket, weak[bucket]);
+    }
+    fclose(fd);
+    return 1;
+}
+
+/* a passage that has at least one of the drilled n-grams and its score */
+struct drill_candidate {
+    uint32_t passage;
+    uint64_t score;
+};
+
+int compare_candidates(const void *a, const void *b) {
+    const struct drill_candidate *x = a, *y = b;
+    return (x->passage > y->passage) - (x->passage < y->passage);
+}
+
+/* scores the passages listed for the user's DRILL_NGRAMS weakest n-grams by
+ * the density of those n-grams in them and returns the best one not already
+ * in drilled, or -1.  Only the postings of those n-grams are read, so this
+ * doesn't grow with the corpus */
+int select_drill(const struct ngram_index *index, const int *weak,
+                 const int *drilled, int ndrilled) {
+    int top[DRILL_NGRAMS];
+    int ntop = 0;
+    int bucket, j, best = -1;
+    uint64_t k, ncandidates = 0, score;
+    uint32_t p;
+    double density, best_density = 0;
+    struct drill_candidate *candidates;
+
+    /* keep the weakest n-grams sorted in top by insertion */
+    for (bucket = 0; bucket < NGRAM_BUCKETS; bucket++) {
+        if (!weak[bucket]) continue;
+        if (ntop == DRILL_NGRAMS && weak[bucket] <= weak[top[ntop - 1]])
+            continue;
+        if (ntop < DRILL_NGRAMS) ntop++;
+        for (j = ntop - 1; j > 0 && weak[top[j - 1]] < weak[bucket]; j--) {
+            top[j] = top[j - 1];
+        }
+        top[j] = bucket;
+    }
+    if (!ntop) return -1;
+
+    candidates = malloc(ntop * NGRAM_POSTINGS *
+                        sizeof(struct drill_candidate));
+    if (!candidates) {
+        perror("Error allocating memory for drill scores");
+        return -1;
+    }
+    for (j = 0; j < ntop; j++) {
+        for (k = index->table[top[j]]; k < index->table[top[j] + 1]; k++) {
+            candidates[ncandidates].passage = index->postings[k].passage;
+            candidates[ncandidates].score =
+                (uint64_t)weak[top[j]] * index->postings[k].count;
+            ncandidates++;
+        }
+    }
+    /* bring the postings of each passage together to add up its score */
+    qsort(candidates, ncandidates, sizeof(struct drill_candidate),
+          compare_candidates);
+    for (k = 0; k < ncandidates; k += j) {
+        p = candidates[k].passage;
+        score = 0;
+        for (j = 0; k + j < ncandidates && candidates[k + j].passage == p;
+             j++) {
+            score += candidates[k + j].score;
+        }
+        for (bucket = 0; bucket < ndrilled && drilled[bucket] != p; bucket++);
+        if (bucket < ndrilled || !index->passages[p].length) continue;
+        /* a small file is only a line or two, count it as a full passage so
+         * drills stay about a screen long */
+        density = (double)score / (index->passages[p].length > PASSAGE_SIZE ?
+                                   index->passages[p].length : PASSAGE_SIZE);
+        if (density > best_density) {
+            best_density = density;
+            best = p;
+        }
+    }
+    free(candidates);
+    return best;
 }
 
-/* estimates the comment syntax for a file based on filename and contents */
-unsigned short int commentType(char *filename, const char *buffer) {
-    unsigned short int syntax = 0;
+/* GHOSTS **********************************************************************
+ * Racing (-g) replays the user's best run of a screen as a ghost cursor next
+ * to their own.  Every run is recorded as a timeline of where the cursor was
+ * after each keystroke, and the best run of each screen is kept in
+ * $HOME/.nctyping-ghosts as a list of records of varints:
+ *
+ *   name length | name | begin | count | count * (ms delta, position delta)
+ *
+ * position deltas are zigzag encoded since backspaces move the cursor back.
+ * The file is read once per document into a ghost_book, and the runs that
+ * beat their ghost are written back together when the document is done.
+ */
 
-    char *ext = filename;
-    while (*ext != '.' && *ext) ext++;
+/* a run that beat the ghost of its screen, encoded as a ghost record */
+struct ghost_record {
+    struct ghost_record *next;
+    int begin;
+    unsigned char *data;
+    size_t length;
+};
 
-    if (*ext == '.') ext++;
+/* the ghost file as it was when a document was opened and the runs of that
+ * document that are to replace some of its records */
+struct ghost_book {
+    const unsigned char *data;
+    long size;
+    struct ghost_record *improved;
+    struct arena *arena;  /* where the book and its records are allocated */
+};
 
-    /* Syntax mask so far:
-     * 0-bit = // inline
-     * 1-bit = # inline
-     * 8-bit = / * to * / block (without spaces)
-     * 9-bit = <# to #> block
-     * 10-bit = ''' block
-     * 11-bit = """ block
-     */
-    if (!strcmp(ext, "c") || !strcmp(ext, "h") || !strcmp(ext, "cc") ||
-        !strcmp(ext, "cpp") || !strcmp(ext, "cxx") || !strcmp(ext, "hpp") ||
-        !strcmp(ext, "c++") || !strcmp(ext, "cs") || !strcmp(ext, "java") ||
-        !strcmp(ext, "rs") || !strcmp(ext, "rlib") || !strcmp(ext, "d") ||
-        !strcmp(ext, "js")) {
-        syntax = DOUBLESLASHINLINE | SLASHSTARBLOCK;
-    } else if (!strncmp(buffer, "#!/usr/bin/env py",
-                        strlen("#!/usr/bin/env py")) ||
-               !strcmp(ext, "py") || !strcmp(ext, "pyc") ||
-               !strcmp(ext, "pyd") || !strcmp(ext, "pyo") ||
-               !strcmp(ext, "pyw") || !strcmp(ext, "pyz")) {
-        syntax = SINGLEHASHINLINE | TRIPLESQUOTEBLOCK | TRIPLEDQUOTEBLOCK;
-    } else if (!strncmp(buffer, "#!/usr/bin/env php",
-                        strlen("#!/usr/bin/env php")) ||
-               !strcmp(ext, "php") || !strcmp(ext, "phtml") ||
-               !strcmp(ext, "php3") || !strcmp(ext, "php4") ||
-               !strcmp(ext, "php5") || !strcmp(ext, "php7") ||
-               !strcmp(ext, "phps")) {
-        syntax = DOUBLESLASHINLINE | SINGLEHASHINLINE | SLASHSTARBLOCK;
-    } else if (!strncmp(buffer, "#!/bin/bash", strlen("#!/bin/bash")) ||
-               !strncmp(buffer, "#!/bin/sh", strlen("#!/bin/sh")) ||
-               !strncmp(buffer, "#!/bin/csh", strlen("#!/bin/csh")) ||
-               !strncmp(buffer, "#!/usr/bin/awk", strlen("#!/usr/bin/awk")) ||
-               !strcmp(ext, "bash") || !strcmp(ext, "tcl") ||
-               !strcmp(ext, "csh") || !strcmp(ext, "mpl") ||
-               !strcmp(ext, "mla") || !strcmp(ext, "ps1") ||
-               !strcmp(ext, "m") || !strcmp(ext, "r") || !strcmp(ext, "sh") ||
-               !strncmp(buffer, "#!/usr/bin/Rscript",
-                        strlen("#!/usr/bin/Rscript"))) {
-        syntax = SINGLEHASHINLINE | ANGLEHASHBLOCK;
-    } else if (!strncmp(buffer, "%PDF-", strlen("%PDF-"))) {
-        fprintf(stderr, "nctyping currently does not support pdf-to-text\n");
-        exit(-1);
-    } else {
-        syntax = 0;
+/* reads a varint from *p without going past end, returns 0 if truncated */
+int get_varint(const unsigned char **p, const unsigned char *end,
+               uint64_t *value) {
+    int shift = 0;
+    *value = 0;
+    while (*p < end && shift < 64) {
+        *value |= (uint64_t)(**p & 127) << shift;
+        if (!(*(*p)++ & 128)) return 1;
+        shift += 7;
     }
-    return syntax;
+    return 0;
 }
 
-/* toggles flags for comment fields based on interpretation of the file lang */
-void markComments(char *filename, const char *buffer, char *flags, int size,
-                  bool ignoreComments) {
-    unsigned short int syntax = commentType(filename, buffer);
-    char* pos;
-    int i;
-    int comment_len = 0;
-    for (i = 0; i < size; i++) {
-        if (!ignoreComments) {
-            if (syntax & DOUBLESLASHINLINE && !comment_len) {
-                comment_len = commentLength(buffer, &i, "//", "\n");
-            }
-            if (syntax & SINGLEHASHINLINE && !comment_len) {
-                comment_len = commentLength(buffer, &i, "#", "\n");
-            }
-            if (syntax & SLASHSTARBLOCK && !comment_len) {
-                comment_len = commentLength(buffer, &i, "/*", "*/");
-            }
-            if (syntax & ANGLEHASHBLOCK && !comment_len) {
-                comment_len = commentLength(buffer, &i, "<#", "#>");
-            }
-            if (syntax & TRIPLESQUOTEBLOCK && !comment_len) {
-                comment_len = commentLength(buffer, &i, "'''", "'''");
-            }
-            if (syntax & TRIPLEDQUOTEBLOCK && !comment_len) {
-                comment_len = commentLength(buffer, &i, "\"\"\"", "\"\"\"");
-            }
-        }
-        if (comment_len) {
-            flags[i] |= COMMENT;
-            comment_len--;
-        }
-        /* Mark isolated white space as comments as well */
-        if (!comment_len && buffer[i] == '\n') {
-            comment_len = strspn(buffer + (i + 1), " \n\t");
-        }
-        if (!comment_len && buffer[i] == ' ') {
-            comment_len = strspn(buffer + (i + 1), " \n\t");
-        }
+/* writes value at p as a varint, 7 bits at a time, returns the end of it */
+unsigned char *put_varint(unsigned char *p, uint64_t value) {
+    while (value > 127) {
+        *p++ = (value & 127) | 128;
+        value >>= 7;
     }
+    *p++ = value;
+    return p;
 }
 
-/* fills the screen with the char filler, current_color only maintains state */
-void clearscreen(int height, int width, int current_color, int filler) {
-    if (current_color)
-        attroff(COLOR_PAIR(current_color));
-    int x, y;
-    for (x = 0; x < width; x++) {
-        for (y = 0; y < height; y++) {
-            mvaddch(y, x, filler);
+/* appends the cursor position at time ms to a timeline */
+void timeline_add(struct timeline *timeline, int ms, int position) {
+    int *times, *positions;
+    if (timeline->count == timeline->capacity) {
+        /* the old arrays are left in the arena until it is reset */
+        times = arena_alloc(timeline->arena,
+                            (timeline->capacity ? timeline->capacity * 2
+                                                : 256) * sizeof(int));
+        positions = arena_alloc(timeline->arena,
+                                (timeline->capacity ? timeline->capacity * 2
+                                                    : 256) * sizeof(int));
+        if (!times || !positions) return;
+        if (timeline->count) {
+            memcpy(times, timeline->times, timeline->count * sizeof(int));
+            memcpy(positions, timeline->positions,
+                   timeline->count * sizeof(int));
         }
+        timeline->times = times;
+        timeline->positions = positions;
+        timeline->capacity = timeline->capacity ? timeline->capacity * 2 : 256;
     }
-    if (current_color)
-        attron(COLOR_PAIR(current_color));
+    timeline->times[timeline->count] = ms;
+    timeline->positions[timeline->count] = position;
+    timeline->count++;
 }
 
-/* returns color pair for typed chars based on the time it took to type them */
-int colortiming(int flag) {
-    if (flag & MISTAKE1 && flag & MISTAKE2) {
-        return 7;
-    } else if (flag & MISTAKE2) {
-        return 6;
-    } else if (flag & MISTAKE1) {
-        return 5;
+/* reads the whole ghost file into book, leaving it empty if there is none */
+void read_ghosts(const char *ghostpath, struct ghost_book *book,
+                 struct arena *arena) {
+    unsigned char *data;
+    FILE *fd = fopen(ghostpath, "r");
+    memset(book, 0, sizeof(struct ghost_book));
+    book->arena = arena;
+    if (!fd) return;
+    fseek(fd, 0L, SEEK_END);
+    book->size = ftell(fd);
+    fseek(fd, 0L, SEEK_SET);
+    data = arena_alloc(arena, book->size > 0 ? book->size : 1);
+    if (data && fread(data, 1, book->size, fd) == book->size) {
+        book->data = data;
     } else {
-        return 4;
+        book->size = 0;
     }
+    fclose(fd);
 }
 
-/* reads typeable content from a file and populates the buffer for typing() */
-int file_pop(char *filename, char **buffer, char **flags) {
-    FILE *fd;
-    int i = 0;
-    char sub;
-    int size, j;
-    fd = fopen(filename, "r");
-    if (fd == NULL) {
-        perror("Error opening file");
-        return i;
+/* parses the ghost record at *p, leaving *p after it.  The timeline is only
+ * decoded into timeline when it isn't NULL.  Returns 0 if the record is
+ * truncated */
+int parse_ghost(const unsigned char **p, const unsigned char *end,
+                const unsigned char **name, uint64_t *namelen,
+                uint64_t *begin, struct timeline *timeline) {
+    uint64_t count, dt, dpos, k;
+    int ms = 0;
+    int position;
+    if (!get_varint(p, end, namelen) || *namelen > end - *p) return 0;
+    *name = *p;
+    *p += *namelen;
+    if (!get_varint(p, end, begin) || !get_varint(p, end, &count)) return 0;
+    position = *begin;
+    for (k = 0; k < count; k++) {
+        if (!get_varint(p, end, &dt) || !get_varint(p, end, &dpos)) return 0;
+        if (timeline) {
+            ms += dt;
+            position += (dpos & 1) ? -(int)(dpos >> 1) - 1 : (int)(dpos >> 1);
+            timeline_add(timeline, ms, position);
+        }
     }
+    return 1;
+}
 
-    /* getting the file size */
-    if (strcmp(filename, "/dev/stdin")) {
-        fseek(fd, 0L, SEEK_END);
-        size = ftell(fd);
-        fseek(fd, 0L, SEEK_SET);
+/* whether a record parsed by parse_ghost() is for the screen of filename
+ * starting at begin */
+int is_ghost_of(const unsigned char *name, uint64_t namelen, uint64_t start,
+                const char *filename, int begin) {
+    return start == begin && namelen == strlen(filename) &&
+           !memcmp(name, filename, namelen);
+}
 
-        /* need to count tabs in order to account for them in size of buffer */
-        while (!feof(fd)) {
-            if (fgetc(fd) == '\t')
-                size += 3;
+/* loads the best run of the screen of filename starting at begin into ghost,
+ * preferring a run from this document over the one in the file */
+int load_ghost(const struct ghost_book *book, const char *filename, int begin,
+               struct timeline *ghost) {
+    const unsigned char *p, *record, *name;
+    const struct ghost_record *improved;
+    uint64_t namelen, start;
+    for (improved = book->improved; improved; improved = improved->next) {
+        if (improved->begin == begin) {
+            p = improved->data;
+            return parse_ghost(&p, p + improved->length, &name, &namelen,
+                               &start, ghost);
         }
-        fseek(fd, 0L, SEEK_SET);
-    } else {
-    /* need a constant size for a stdin buffer because fseek isn't possible */
-        size = 1024 * 1024;
     }
+    p = book->data;
+    while (p && p < book->data + book->size) {
+        record = p;
+        if (!parse_ghost(&p, book->data + book->size, &name, &namelen,
+                         &start, NULL))
+            break;
+        if (is_ghost_of(name, namelen, start, filename, begin)) {
+            /* parse again, this time keeping the timeline */
+            p = record;
+            return parse_ghost(&p, book->data + book->size, &name, &namelen,
+                               &start, ghost);
+        }
+    }
+    return 0;
+}
 
-    *buffer = malloc(size);
-    *flags = malloc(size);
-    if (!(*buffer) || !(*flags)) {
-        perror("Error allocating memory for file buffer");
-        return i;
+/* keeps run as the ghost of its screen in book if it is faster than the
+ * current one, it is only written out by save_ghosts() */
+int keep_ghost(struct ghost_book *book, const char *filename, int begin,
+               const struct timeline *run, const struct timeline *ghost) {
+    struct ghost_record *improved;
+    unsigned char *p;
+    int64_t delta;
+    int k;
+
+    if (!run->count) return 0;
+    if (ghost->count &&
+        (run->positions[run->count - 1] < ghost->positions[ghost->count - 1] ||
+         run->times[run->count - 1] >= ghost->times[ghost->count - 1]))
+        return 0;
+
+    for (improved = book->improved; improved; improved = improved->next) {
+        if (improved->begin == begin) break;
+    }
+    if (!improved) {
+        improved = arena_alloc(book->arena, sizeof(struct ghost_record));
+        if (!improved) return 0;
+        improved->next = book->improved;
+        improved->begin = begin;
+        book->improved = improved;
+    }
+    /* every varint takes at most 10 bytes */
+    p = arena_alloc(book->arena, strlen(filename) + 30 + run->count * 20);
+    if (!p) {
+        improved->length = 0;
+        return 0;
+    }
+    improved->data = p;
+    p = put_varint(p, strlen(filename));
+    memcpy(p, filename, strlen(filename));
+    p += strlen(filename);
+    p = put_varint(p, begin);
+    p = put_varint(p, run->count);
+    for (k = 0; k < run->count; k++) {
+        p = put_varint(p, run->times[k] - (k ? run->times[k - 1] : 0));
+        delta = run->positions[k] - (k ? run->positions[k - 1] : begin);
+        /* zigzag: small negative deltas stay small */
+        p = put_varint(p, delta < 0 ? ((-delta - 1) << 1) | 1 : delta << 1);
     }
+    improved->length = p - improved->data;
+    return 1;
+}
 
-    memset(*flags, 0, size);
+/* writes the runs book has kept for filename over their old records,
+ * rewriting the ghost file through a temporary file */
+int save_ghosts(const char *ghostpath, const char *filename,
+                const struct ghost_book *book) {
+    const unsigned char *p, *record, *name;
+    const struct ghost_record *improved;
+    uint64_t namelen, start;
+    FILE *fd;
+    char *tmppath;
 
-    while (!feof(fd) && i < size) {
-        sub = fgetc(fd);
-        if (sub == '\n' || (sub > 31 && sub < 127)) {
-            if (sub == '\n') (*flags)[i] |= NEWLINE;
-            (*buffer)[i] = sub;
-            i++;
-        /* tabs are treated as 4 spaces */
-        } else if (sub == '\t') {
-            for (j = 0; j < 3 && i < size; j++) {
-                (*buffer)[i] = ' ';
-                i++;
-            }
+    if (!book->improved) return 1;
+    tmppath = malloc(strlen(ghostpath) + strlen(".tmp") + 1);
+    strcpy(tmppath, ghostpath);
+    strcat(tmppath, ".tmp");
+    fd = fopen(tmppath, "w");
+    if (!fd) {
+        free(tmppath);
+        return 0;
+    }
+    /* copy every other record over unchanged */
+    p = book->data;
+    while (p && p < book->data + book->size) {
+        record = p;
+        if (!parse_ghost(&p, book->data + book->size, &name, &namelen,
+                         &start, NULL))
+            break;
+        for (improved = book->improved; improved; improved = improved->next) {
+            if (improved->length &&
+                is_ghost_of(name, namelen, start, filename, improved->begin))
+                break;
         }
+        if (!improved) fwrite(record, 1, p - record, fd);
     }
-    if (fclose(fd) == EOF) {
-        perror("Error closing file");
+    for (improved = book->improved; improved; improved = improved->next) {
+        fwrite(improved->data, 1, improved->length, fd);
+    }
+    if (fclose(fd) == EOF || rename(tmppath, ghostpath) == -1) {
+        free(tmppath);
+        return 0;
+    }
+    free(tmppath);
+    return 1;
+}
+
+/* microseconds elapsed since a CLOCK_MONOTONIC time */
+long elapsed_us(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000 +
+           (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+long elapsed_ms(const struct timespec *since) {
+    return elapsed_us(since) / 1000;
+}
+
+/* moves the ghost cursor to position, walking xs the same way typing() moves
+ * the user cursor, and redraws it in its own color.  The cell it leaves is
+ * restored unless the user has drawn over it in the meantime */
+void move_ghost(struct race *race, int position, const char *xs,
+                int screen_start, int used) {
+    int k;
+    if (position > used - 1) position = used - 1;
+    if (position < screen_start) position = screen_start;
+    if (race->gx && (mvinch(race->gy, race->gx) & A_COLOR) == COLOR_PAIR(10))
+        mvaddch(race->gy, race->gx, race->under);
+    for (k = race->position + 1; k <= position; k++) {
+        if (xs[k - screen_start] <= xs[k - screen_start - 1]) race->gy++;
+    }
+    for (k = race->position; k > position; k--) {
+        if (xs[k - screen_start] <= xs[k - screen_start - 1]) race->gy--;
+    }
+    race->position = position;
+    race->gx = xs[position - screen_start];
+    race->under = mvinch(race->gy, race->gx);
+    mvaddch(race->gy, race->gx,
+            (race->under & (A_CHARTEXT | A_ALTCHARSET)) | COLOR_PAIR(10));
+}
+
+/* whether a key is waiting to be read, without waiting for one */
+bool key_pending(void) {
+    struct pollfd in = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&in, 1, 0) > 0;
+}
+
+/* waits up to wait milliseconds (forever if negative) for a key, noting in
+ * keyed when it arrived so its latency includes everything drawn after that.
+ * busy is the earliest a key that is already waiting could have arrived:
+ * it is counted from then, so the work it waited behind shows up in its
+ * latency.
+ * RETURNS: the key, or ERR on timeout */
+int wait_key(int wait, const struct timespec *busy, struct timespec *keyed) {
+    struct pollfd in = { STDIN_FILENO, POLLIN, 0 };
+    int key;
+    refresh();
+    if (key_pending()) {
+        *keyed = *busy;
+    } else if (poll(&in, 1, wait) > 0) {
+        clock_gettime(CLOCK_MONOTONIC, keyed);
+    } else {
+        return ERR;
+    }
+    /* ncurses reads keys a byte at a time, so the key is still in stdin
+     * where poll() can see it and getch() won't block */
+    timeout(0);
+    key = getch();
+    timeout(-1);
+    return key;
+}
+
+/* waits for the next key while replaying the ghost.  Instead of polling, the
+ * wait times out exactly when the next ghost event is due, so a keystroke is
+ * returned the moment it arrives.  A ghost event that is due while a key is
+ * waiting is only drawn after the key, and redraws are timed on their own
+ * into score.  busy and keyed are as in wait_key() */
+int race_key(struct race *race, const char *xs, int screen_start, int used,
+             const struct timespec *started, struct timespec *busy,
+             struct timespec *keyed, struct scoring *score, int height,
+             int width) {
+    long now, drawn;
+    int key, moved, wait;
+    for (;;) {
+        now = elapsed_ms(started);
+        moved = 0;
+        while (race->next < race->ghost.count &&
+               race->ghost.times[race->next] <= now) {
+            race->next++;
+            moved = 1;
+        }
+        if (moved && !key_pending()) {
+            /* any key from here on arrived during the redraw at the earliest */
+            clock_gettime(CLOCK_MONOTONIC, busy);
+            move_ghost(race, race->ghost.positions[race->next - 1], xs,
+                       screen_start, used);
+            move(height - 1, width - 1);
+            refresh();
+            drawn = elapsed_us(busy);
+            score->ghost_total += drawn;
+            if (drawn > score->ghost_max) score->ghost_max = drawn;
+            score->ghost_samples++;
+        } else if (moved) {
+            /* draw it on the next pass instead */
+            race->next--;
+        }
+        wait = -1;
+        if (race->next < race->ghost.count) {
+            wait = race->ghost.times[race->next] - now;
+            if (wait < 0) wait = 0;
+        }
+        key = wait_key(wait, busy, keyed);
+        if (key != ERR) return key;
     }
-    return i;
 }
 
 /* Where almost all the action happens, displays a screen from the buffer and
@@ -266,20 +2116,29 @@ int file_pop(char *filename, char **buffer, char **flags) {
  * height, width: useable screen dimensional
  * filename: a string containing the name of the file in buffer
  * score: structure that is used to return typing stats (right, wrong, time)
+ * race: ghost to race and where to record this run, NULL when not racing
+ * scratch: arena for state that only lives as long as this screen
  * RETURNS: how much of the buffer was completed before moving to next screen
  */
 int typing(const char *buffer, char *flags, int size, int begin, int height,
-           int width, char* filename, struct scoring *score) {
-    /* start: time first key is typed */
+           int width, char* filename, struct scoring *score,
+           struct race *race, struct arena *scratch) {
+    /* start: time first key is typed
+     * started: the same in monotonic time for ghosts and latency, keyed is
+     * when the current key arrived and busy the earliest the next one could
+     * have, see wait_key() */
     time_t start;
+    struct timespec started, keyed, busy;
     bool isStarted = false;
     char *xs;
+    long latency;
+    int key;
 
     if (height * width < size - begin) {
-        xs = malloc(height * width);
+        xs = arena_alloc(scratch, height * width);
         memset(xs, 0, height * width);
     } else {
-        xs = malloc(size - begin);
+        xs = arena_alloc(scratch, size - begin);
         memset(xs, 0, size - begin);
     }
 
@@ -295,6 +2154,7 @@ int typing(const char *buffer, char *flags, int size, int begin, int height,
     int used = 0;   /* # chars must be typed on this screen TODO remove */
 
     /* Initializing the ncurses screen */
+    clock_gettime(CLOCK_MONOTONIC, &busy);
     initscr();
     cbreak();
     noecho();
@@ -310,6 +2170,14 @@ int typing(const char *buffer, char *flags, int size, int begin, int height,
     init_pair(7, COLOR_RED, COLOR_BLACK);      /* 3 mistake match */
     init_pair(8, COLOR_BLACK, COLOR_WHITE);    /* newline char */
     init_pair(9, COLOR_BLUE, COLOR_BLACK);     /* commented code */
+    init_pair(10, COLOR_BLACK, COLOR_BLUE);    /* ghost cursor */
+
+    score->latency_total = 0;
+    score->latency_max = 0;
+    score->latency_samples = 0;
+    score->ghost_total = 0;
+    score->ghost_max = 0;
+    score->ghost_samples = 0;
 
     x = 1;
     y = 0;
@@ -357,6 +2225,13 @@ int typing(const char *buffer, char *flags, int size, int begin, int height,
     y = 0;
 
     i = screen_start;
+    if (race) {
+        race->next = 0;
+        race->position = screen_start;
+        race->gx = 0;
+        race->gy = 0;
+        race->finished = false;
+    }
     /* Check if user types key associated with cursor char
      *  if not, draw that character with red background */
     while (i < used || streak) {
@@ -368,7 +2243,7 @@ int typing(const char *buffer, char *flags, int size, int begin, int height,
 
             /* handle issue with trailing typeable space after comments */
             if (!(i < used || streak)) {
-                free(xs);
+                if (race) race->finished = true;
                 endwin();
                 score->right = right;
                 score->wrong = wrong;
@@ -385,8 +2260,18 @@ int typing(const char *buffer, char *flags, int size, int begin, int height,
             move(height - 1, width - 1);
         }
 
-        /* GET USER INPUT */
-        sub = getch();
+        /* GET USER INPUT, the ghost only starts with the user */
+        if (race && isStarted) {
+            key = race_key(race, xs, screen_start, used, &started, &busy,
+                           &keyed, score, height, width);
+        } else {
+            do {
+                key = wait_key(-1, &busy, &keyed);
+            } while (key == ERR);
+        }
+        /* keys come in order, one waiting behind this key arrived after it */
+        busy = keyed;
+        sub = key;
 
         /* if the user types a tab treat it as a space since tabs are
          * represented as 4 spaces, multiple spaces are treated as comments,
@@ -398,6 +2283,7 @@ int typing(const char *buffer, char *flags, int size, int begin, int height,
         if (!isStarted) {
             isStarted = true;
             start = time(NULL);
+            started = keyed;
         }
         /* handle backspace */
         if (sub == 127) {
@@ -476,8 +2362,16 @@ int typing(const char *buffer, char *flags, int size, int begin, int height,
                ((double)right/(right+wrong))*100, (time(NULL) - start) / 60,
                (time(NULL) - start) % 60);
         move(height - 1, width - 1);
+
+        if (race) timeline_add(&race->run, elapsed_ms(&started), i);
+        /* measure how long this keystroke took to reach the screen */
+        refresh();
+        latency = elapsed_us(&keyed);
+        score->latency_total += latency;
+        if (latency > score->latency_max) score->latency_max = latency;
+        score->latency_samples++;
     }
-    free(xs);
+    if (race) race->finished = !(i < used || streak);
 
     /* Exit TUI window */
     endwin();
@@ -500,11 +2394,11 @@ int update_save(const char *filename, int newpos, const char *savepath) {
         if (!strncmp(filename, subfile + 1, strlen(filename))) {
             fprintf(fd, " %d\n", newpos);
             fflush(fd);
-            close(fd);
+            fclose(fd);
             return 1;
         }
     }
-    close(fd);
+    fclose(fd);
     return -1;
 }
 
@@ -523,11 +2417,11 @@ int search_save(const char *filename, const char *savepath) {
         fscanf(fd, "%s", subfile);
         fscanf(fd, "%s", position);
         if (!strncmp(filename, subfile + 1, strlen(filename))) {
-            close(fd);
+            fclose(fd);
             return atoi(position);
         }
     }
-    close(fd);
+    fclose(fd);
     return -1;
 }
 
@@ -547,7 +2441,7 @@ int save_progress(const char *filename, int position, const char *savepath) {
         }
         fprintf(fd, "\"%s\" %d\n", filename, position);
         fflush(fd);
-        close(fd);
+        fclose(fd);
     }
     return 1;
 }
@@ -555,8 +2449,9 @@ int save_progress(const char *filename, int position, const char *savepath) {
 /* displays the results of a section of typing
  * this is usually the results of a screen of text
  * but may also be triggered by user pressing ESCAPE as a sort of PAUSE
+ * RETURNS: true if the user pressed ESCAPE to exit the program
  */
-void results(struct scoring *score, bool more, int height, int width,
+bool results(struct scoring *score, bool more, int height, int width,
              const char *filename, int begin, const char *savepath) {
     initscr();
     cbreak();
@@ -598,6 +2493,18 @@ void results(struct scoring *score, bool more, int height, int width,
            ((double) score->right / (double)(score->right + score->wrong)) * 100);
     move((height / 2) + 1, (width / 2) - 13);
     printw("Total Keystrokes:  %6d", score->right + score->wrong);
+    if (score->latency_samples) {
+        move((height / 2) + 2, (width / 2) - 13);
+        printw("Latency avg/max : %5.2f/%.2fms",
+               (double)score->latency_total / score->latency_samples / 1000,
+               (double)score->latency_max / 1000);
+    }
+    if (score->ghost_samples) {
+        move(height / 2, (width / 2) - 13);
+        printw("Ghost avg/max   : %5.2f/%.2fms",
+               (double)score->ghost_total / score->ghost_samples / 1000,
+               (double)score->ghost_max / 1000);
+    }
     if (more) {
         move((height / 2) + 3, (width - strlen(options)) / 2);
         printw("%s", options);
@@ -622,12 +2529,11 @@ void results(struct scoring *score, bool more, int height, int width,
             }
             move(height - 1, width - 1);
         } else if (sub == 27) {
-            /* exit on escape, will need a better way to do this since
-             * allocated memory needs to be free()d */
+            /* exit on escape, callers unwind so everything gets free()d */
             attroff(COLOR_PAIR(1));
             clearscreen(height, width, 0, ' ');
             endwin();
-            exit(1);
+            return true;
         }
         sub = getch();
     }
@@ -635,6 +2541,7 @@ void results(struct scoring *score, bool more, int height, int width,
     attroff(COLOR_PAIR(1));
     clearscreen(height, width, 0, ' ');
     endwin();
+    return false;
 }
 
 /* creates an absolute and unique filepath based on filename and working dir
@@ -667,18 +2574,251 @@ void simplify_filename(char *file) {
     *k = '\0';
 }
 
-/* Just a wrapper function for handling splitting the buffer up into screens */
-void running(int argc, char **argv, char **envp) {
+/* types a buffer screen by screen starting at begin, showing results between
+ * screens and adding every mistake to the weakness table as it is made
+ * more: whether results() offers to continue after the last screen
+ * racing: whether to race the best previous run of each screen
+ * RETURNS: true if the user chose to exit from the results screen
+ */
+bool type_buffer(const char *buffer, char *flags, int size, int begin,
+                 char *filename, const struct session *session, bool more,
+                 bool racing) {
     struct winsize w;
     struct scoring score;
-    char *buffer, *flags, *filename, *savepath;
+    struct race race;
+    struct ghost_book book;
+    bool quit = false;
+    int res;
+
+    memset(&race, 0, sizeof(struct race));
+    if (racing) read_ghosts(session->ghostpath, &book, session->document);
+    for (;;) {
+        /* nothing from the last screen is needed anymore */
+        arena_reset(session->screen);
+        if (racing) {
+            memset(&race.ghost, 0, sizeof(struct timeline));
+            memset(&race.run, 0, sizeof(struct timeline));
+            race.ghost.arena = session->screen;
+            race.run.arena = session->screen;
+            load_ghost(&book, filename, begin, &race.ghost);
+        }
+        ioctl(0,TIOCGWINSZ,&w);
+        res = typing(buffer, flags, size, begin, w.ws_row,
+                     w.ws_col > 255 ? 256 : w.ws_col, filename, &score,
+                     racing ? &race : NULL, session->screen);
+        record_weakness(buffer, flags, begin, res, session->weak);
+        save_weakness(session->weak, session->weakpath);
+        if (racing && race.finished) {
+            keep_ghost(&book, filename, begin, &race.run, &race.ghost);
+        }
+        if (res >= size - 1) break;
+        ioctl(0,TIOCGWINSZ,&w);
+        if (results(&score, true, w.ws_row, w.ws_col > 255 ? 256 : w.ws_col,
+                    filename, res, session->savepath)) {
+            quit = true;
+            break;
+        }
+        begin = res;
+    }
+    if (racing) save_ghosts(session->ghostpath, filename, &book);
+    if (quit) return quit;
+    return results(&score, more, w.ws_row, w.ws_col > 255 ? 256 : w.ws_col,
+                   filename, res, session->savepath);
+}
+
+/* drills the passages of the corpus under dir that are richest in the
+ * n-grams the user misses most, building the n-gram index if needed
+ * RETURNS: true if the user chose to exit */
+bool drill(const char *dir, const struct session *session) {
+    struct ngram_index index;
+    struct session quiet = *session;
+    struct arena_mark mark;
+    const struct ngram_passage *passage;
+    int drilled[DRILL_ROUNDS];
+    char *buffer, *flags, *indexpath, *name;
+    int round, size, bucket;
+    int fresh = 0;          /* first round drilled from the current index */
+    bool rebuilt = false;
+    bool quit = false;
+
+    /* don't build an index there is nothing to drill with */
+    for (bucket = 0; bucket < NGRAM_BUCKETS && !session->weak[bucket];
+         bucket++);
+    if (bucket == NGRAM_BUCKETS) {
+        fprintf(stderr, "No mistakes recorded yet to drill in %s\n", dir);
+        return quit;
+    }
+
+    indexpath = arena_alloc(session->document,
+                            strlen(dir) + strlen("/.nctyping-ngrams") + 1);
+    strcpy(indexpath, dir);
+    strcat(indexpath, "/.nctyping-ngrams");
+    if (!load_ngram_index(indexpath, &index)) {
+        fprintf(stderr, "Building n-gram index %s\n", indexpath);
+        if (!build_ngram_index(dir, indexpath) ||
+            !load_ngram_index(indexpath, &index)) {
+            fprintf(stderr, "Unable to build n-gram index for %s\n", dir);
+            return quit;
+        }
+        rebuilt = true;
+    }
+
+    /* drills don't move the position saved for sequential typing */
+    quiet.savepath = "/dev/null";
+    mark = arena_mark(session->document);
+    for (round = 0; round < DRILL_ROUNDS && !quit; round++) {
+        drilled[round] = select_drill(&index, session->weak, drilled + fresh,
+                                      round - fresh);
+        if (drilled[round] == -1) {
+            if (!round) {
+                fprintf(stderr, "No passages to drill in %s\n", dir);
+            }
+            break;
+        }
+        passage = &index.passages[drilled[round]];
+        arena_release(session->document, mark);
+        /* the index names files relative to the corpus */
+        name = arena_alloc(session->document, strlen(dir) +
+                           strlen(index.names +
+                                  index.files[passage->file].name) + 2);
+        sprintf(name, "%s/%s", dir, index.names +
+                index.files[passage->file].name);
+        /* only the files actually drilled are checked, so loading the index
+         * doesn't grow with the corpus.  A stale file rebuilds it once */
+        if (!rebuilt && !ngram_file_fresh(&index.files[passage->file], name)) {
+            munmap(index.map, index.map_size);
+            fprintf(stderr, "Rebuilding n-gram index %s\n", indexpath);
+            if (!build_ngram_index(dir, indexpath) ||
+                !load_ngram_index(indexpath, &index)) {
+                fprintf(stderr, "Unable to build n-gram index for %s\n",
+                        dir);
+                return quit;
+            }
+            rebuilt = true;
+            /* passages of the old index mean nothing in the new one */
+            fresh = round--;
+            continue;
+        }
+        size = range_pop(name, passage->offset, passage->length, &buffer,
+                         &flags, session->document);
+        if (!size) break;
+        markComments(name, buffer, flags, size, false);
+        quit = type_buffer(buffer, flags, size, 0, name, &quiet,
+                           round < DRILL_ROUNDS - 1, false);
+    }
+    munmap(index.map, index.map_size);
+    return quit;
+}
+
+/* types WARMUP_ROUNDS passages starting at random lines of filename
+ * RETURNS: true if the user chose to exit */
+bool warmup(char *filename, const struct session *session) {
+    struct line_index index;
+    struct session quiet = *session;
+    struct arena_mark mark;
+    char *buffer, *flags;
+    uint64_t line;
+    int round, size, begin;
+    bool quit = false;
+
+    if (!load_line_index(filename, session->linedir, &index)) return quit;
+    /* warm-ups don't move the position saved for sequential typing */
+    quiet.savepath = "/dev/null";
+    mark = arena_mark(session->document);
+    srand(time(NULL) ^ getpid());
+    for (round = 0; round < WARMUP_ROUNDS && !quit; round++) {
+        /* rand() alone may not reach every line of a huge file */
+        line = (((uint64_t)rand() << 31) | rand()) % index.nlines;
+        begin = 0;
+        arena_release(session->document, mark);
+        size = sample_pop(filename, &index, line, &begin, &buffer, &flags,
+                          session->document);
+        if (!size) break;
+        quit = type_buffer(buffer, flags, size, begin, filename, &quiet,
+                           round < WARMUP_ROUNDS - 1, false);
+    }
+    munmap(index.map, index.map_size);
+    return quit;
+}
+
+/* types every file found by walking root in manifest order, starting on the
+ * first file as soon as the walk finds it
+ * more: whether there are more arguments to type after this tree
+ * RETURNS: true if the user chose to exit
+ */
+bool type_tree(const char *root, bool ignoreComments, bool more, bool racing,
+               const struct session *session) {
+    struct tree_walk walk;
+    struct manifest_entry entry, next;
+    struct arena_mark mark;
+    char *buffer, *flags;
+    int n, size, res;
+    int typed = 0;          /* files opened for typing */
+    long long bytes = 0;    /* and their size */
+    bool quit = false;
+
+    if (!start_walk(&walk, root)) return quit;
+    mark = arena_mark(session->document);
+    for (n = 0; !quit && walk_entry(&walk, n, &entry); n++) {
+        arena_release(session->document, mark);
+        size = file_pop(entry.path, &buffer, &flags, session->document);
+        if (size) {
+            res = search_save(entry.path, session->savepath);
+            if (res == -1) res = 0;
+            markSyntax(entry.syntax, buffer, flags, size, ignoreComments);
+            typed++;
+            bytes += size;
+            quit = type_buffer(buffer, flags, size, res, entry.path, session,
+                               more || walk_entry(&walk, n + 1, &next),
+                               racing);
+        }
+    }
+    finish_walk(&walk, quit);
+    printf("Typed %d files (%lld bytes) under %s\n", typed, bytes, root);
+    free_manifest(&walk.manifest);
+    return quit;
+}
+
+/* makes path absolute using the PWD entry of envp (if any) and simplifies it
+ * with simplify_filename(), the result is allocated from arena */
+char *absolute_path(const char *path, char **envp, int pwd,
+                    struct arena *arena) {
+    char *filename;
+    /* if PWD was used in filename, append filename to the end.
+     * assume PWD didn't have any /../ or /./ entries */
+    if (pwd == -1 || path[0] == '/') {
+        filename = arena_alloc(arena, strlen(path) + 1);
+        strcpy(filename, path);
+    } else {
+        filename = arena_alloc(arena, strlen(envp[pwd]) + strlen(path) - 2);
+        strcpy(filename, envp[pwd] + 4);
+        strcat(filename, "/");
+        strcat(filename, path);
+    }
+    simplify_filename(filename);
+    return filename;
+}
+
+/* Just a wrapper function for handling splitting the buffer up into screens
+ * RETURNS: 1 if the user exited early with ESCAPE, 0 otherwise */
+int running(int argc, char **argv, char **envp) {
+    struct session session;
+    struct arena document = {"document", NULL, NULL, 0, 0, 0, 0, 0};
+    struct arena screen = {"screen", NULL, NULL, 0, 0, 0, 0, 0};
+    char *buffer, *flags, *filename;
+    char *savepath = NULL;
+    char *weakpath = NULL;
+    char *ghostpath = NULL;
+    char *linedir = NULL;
     int size, res;
     int pwd = -1;
     int i = 0;
     bool ignoreComments = false;
+    bool racing = false;
+    bool quit = false;
 
     /* this loop finds the HOME option in **envp to find paths */
-    while (envp[i] && (savepath[0] == 0 || pwd == -1)) {
+    while (envp[i] && (!savepath || pwd == -1)) {
         /* find absolute path for filename based on pwd */
         if (!strncmp("PWD=", envp[i], 4)) {
             pwd = i;
@@ -687,47 +2827,96 @@ void running(int argc, char **argv, char **envp) {
             savepath = malloc(strlen(envp[i]) + strlen("/.nctyping-restore"));
             strcpy(savepath, envp[i] + 5);
             strcpy(savepath + strlen(savepath), "/.nctyping-restore");
+            weakpath = malloc(strlen(envp[i]) + strlen("/.nctyping-weak"));
+            strcpy(weakpath, envp[i] + 5);
+            strcpy(weakpath + strlen(weakpath), "/.nctyping-weak");
+            ghostpath = malloc(strlen(envp[i]) + strlen("/.nctyping-ghosts"));
+            strcpy(ghostpath, envp[i] + 5);
+            strcpy(ghostpath + strlen(ghostpath), "/.nctyping-ghosts");
+            linedir = malloc(strlen(envp[i]) + strlen("/.nctyping-lines"));
+            strcpy(linedir, envp[i] + 5);
+            strcpy(linedir + strlen(linedir), "/.nctyping-lines");
         }
         i++;
     }
     /* if we can't create a save path, try /dev/null */
     if (!savepath) {
         fprintf(stderr, "envp HOME entry missing, saving not possible\n");
-        savepath = malloc(strlen("/dev/null"));
+        savepath = malloc(strlen("/dev/null") + 1);
         strcpy(savepath, "/dev/null");
+        weakpath = malloc(strlen("/dev/null") + 1);
+        strcpy(weakpath, "/dev/null");
+        ghostpath = malloc(strlen("/dev/null") + 1);
+        strcpy(ghostpath, "/dev/null");
     }
+    session.savepath = savepath;
+    session.weakpath = weakpath;
+    session.ghostpath = ghostpath;
+    session.linedir = linedir;
+    session.weak = load_weakness(weakpath);
+    session.document = &document;
+    session.screen = &screen;
 
     i = 0;
     /* this for loop will take us through each file to be typed */
-    for (i = 1; i < argc; i++) {
-        /* check if we want to avoid comment syntax recognition */
-        if (!strcmp(argv[i], "-c")) {
-            ignoreComments = true;
+    for (i = 1; i < argc && session.weak && !quit; i++) {
+        /* check if we want to avoid comment syntax recognition or to race
+         * a ghost for the next file or directory */
+        while (i < argc - 1 &&
+               (!strcmp(argv[i], "-c") || !strcmp(argv[i], "-g"))) {
+            if (!strcmp(argv[i], "-c")) {
+                ignoreComments = true;
+            } else {
+                racing = true;
+            }
+            i++;
+        }
+        if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "-g")) break;
+
+        /* nothing from the last document is needed anymore */
+        arena_reset(&document);
+        /* drill weak n-grams from a corpus directory */
+        if (!strcmp(argv[i], "-d")) {
             if (i < argc - 1) {
                 i++;
-            } else {
-                return;
+                filename = absolute_path(argv[i], envp, pwd, &document);
+                quit = drill(filename, &session);
+            }
+            ignoreComments = false;
+            racing = false;
+            continue;
+        }
+        /* warm up on random passages of a file */
+        if (!strcmp(argv[i], "-w")) {
+            if (i < argc - 1) {
+                i++;
+                filename = absolute_path(argv[i], envp, pwd, &document);
+                quit = warmup(filename, &session);
+            }
+            ignoreComments = false;
+            racing = false;
+            continue;
+        }
+        /* type every text file under a directory */
+        if (!strcmp(argv[i], "-r")) {
+            if (i < argc - 1) {
+                i++;
+                filename = absolute_path(argv[i], envp, pwd, &document);
+                quit = type_tree(filename, ignoreComments, i < argc - 1,
+                                 racing, &session);
             }
+            ignoreComments = false;
+            racing = false;
+            continue;
         }
         /* check if first arg was '-s' */
         if (!strcmp(argv[i], "-s")) {
-            size = file_pop("/dev/stdin", &buffer, &flags);
-            filename = malloc(strlen("/dev/stdin"));
+            size = file_pop("/dev/stdin", &buffer, &flags, &document);
+            filename = arena_alloc(&document, strlen("/dev/stdin") + 1);
             strcpy(filename, "/dev/stdin");
         } else {
-            size = file_pop(argv[i], &buffer, &flags);
-            /* if PWD was used in filename, append filename to the end.
-             * assume PWD didn't have any /../ or /./ entries */
-            if (pwd == -1 || argv[i][0] == '/') {
-                filename = malloc(strlen(argv[i]) + 1);
-                strcpy(filename, argv[i]);
-            } else {
-                filename = malloc(strlen(envp[pwd]) + strlen(argv[i]) - 2);
-                strcpy(filename, envp[pwd] + 4);
-                strcat(filename, "/");
-                strcat(filename, argv[i]);
-            }
-            simplify_filename(filename);
+            size = file_pop(argv[i], &buffer, &flags, &document);
+            filename = absolute_path(argv[i], envp, pwd, &document);
         }
 
         /* Search for start position from save file */
@@ -736,32 +2925,26 @@ void running(int argc, char **argv, char **envp) {
 
         markComments(filename, buffer, flags, size, ignoreComments);
 
-        ioctl(0,TIOCGWINSZ,&w);
-        res = typing(buffer, flags, size, res, w.ws_row,
-                         w.ws_col > 255 ? 256 : w.ws_col, filename, &score);
-        while (res < size - 1) {
-            ioctl(0,TIOCGWINSZ,&w);
-            results(&score, true, w.ws_row, w.ws_col > 255 ? 256 : w.ws_col,
-                    filename, res, savepath);
-            ioctl(0,TIOCGWINSZ,&w);
-            res = typing(buffer, flags, size, res, w.ws_row,
-                         w.ws_col > 255 ? 256 : w.ws_col, filename, &score);
-        }
-        results(&score, i < argc - 1, w.ws_row, w.ws_col > 255 ? 256 : w.ws_col,
-                filename, res, savepath);
-        free(buffer);
-        free(filename);
+        quit = type_buffer(buffer, flags, size, res, filename, &session,
+                           i < argc - 1, racing);
         ignoreComments = false;
+        racing = false;
     }
+    arena_free(&document);
+    arena_free(&screen);
+    free(session.weak);
+    free(linedir);
+    free(ghostpath);
+    free(weakpath);
     free(savepath);
+    return quit;
 }
 
 int main(int argc, char **argv, char **envp) {
     if (argc < 2) {
-        printf("Usage: %s [-s] [filename] ... [filename]\n", argv[0]);
+        printf("Usage: %s [-c] [-g] [-s] [-d corpus] [-r dir] [-w file] "
+               "[filename] ... [filename]\n", argv[0]);
         return 0;
     }
-    running(argc, argv, envp);
-
-    return 0;
+    return running(argc, argv, envp);
 }